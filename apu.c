@@ -1,57 +1,561 @@
 #include "apu.h"
+#include "nes.h"
 #include <stdio.h>
 
-static uint8_t joy1 = 0;
-static uint8_t joy2 = 0;
-static uint8_t strobe = 0;
-static uint8_t joy1shift = 0;
-static uint8_t joy2shift = 0;
+static const uint8_t length_table[32] = {
+    10, 254, 20,  2, 40,  4, 80,  6, 160,  8, 60, 10, 14, 12, 26, 14,
+    12,  16, 24, 18, 48, 20, 96, 22, 192, 24, 72, 26, 16, 28, 32, 30,
+};
 
-void apu_report_buttonpress(button_t button, bool pressed) {
+// pulse sequences, bit n is step n
+static const uint8_t duty_table[4] = { 0x02, 0x06, 0x1e, 0xf9 };
+
+// timer periods in cpu cycles
+static const uint16_t noise_period[16] = {
+    4, 8, 16, 32, 64, 96, 128, 160, 202, 254, 380, 508, 762, 1016, 2034, 4068,
+};
+static const uint16_t dmc_period[16] = {
+    428, 380, 340, 320, 286, 254, 226, 214, 190, 160, 142, 128, 106, 84, 72, 54,
+};
+
+// frame sequencer steps in cpu cycles from the start of the sequence, the
+// last entry is where the sequence starts over
+static const uint32_t frame_cycles[2][6] = {
+    { 7457, 14913, 22371, 29829, 29830 },
+    { 7457, 14913, 22371, 29829, 37281, 37282 },
+};
+
+// linear approximation of the mixer
+#define PULSE_WEIGHT    0.00752f
+#define TRIANGLE_WEIGHT 0.00851f
+#define NOISE_WEIGHT    0.00494f
+#define DMC_WEIGHT      0.00335f
+
+#define LENGTH_HALT(reg) ((reg) & 0x20)
+#define VOLUME(reg, env) (((reg) & 0x10) ? ((reg) & 0x0f) : (env).decay)
+
+static uint64_t frame_next(const apu_t *apu) {
+    return apu->frame_start + frame_cycles[apu->five_step][apu->frame_step];
+}
+
+// moves a channel output to level at cpu cycle t
+static void set_out(nes_t *nes, uint64_t t, uint8_t *out, uint8_t level, float weight) {
+    if (level != *out) {
+        if (nes->audio) {
+            blip_add_delta(nes->audio, t, (level - *out) * weight);
+        }
+        *out = level;
+    }
+}
+
+static uint16_t sweep_target(const apu_pulse_t *p, int ch) {
+    uint16_t change = p->period >> (p->regs[1] & 7);
+    if (p->regs[1] & 0x08) {
+        // pulse 1 negates in ones' complement
+        return p->period - change - (ch == 0);
+    }
+    return p->period + change;
+}
+
+static bool pulse_muted(const apu_pulse_t *p, int ch) {
+    return p->length == 0 || p->period < 8 || sweep_target(p, ch) > 0x7ff ||
+        VOLUME(p->regs[0], p->env) == 0;
+}
+
+static uint8_t pulse_level(const apu_pulse_t *p, int ch) {
+    if (pulse_muted(p, ch) || !((duty_table[p->regs[0] >> 6] >> p->step) & 1)) {
+        return 0;
+    }
+    return VOLUME(p->regs[0], p->env);
+}
+
+static uint8_t triangle_level(const apu_triangle_t *tri) {
+    return (tri->step < 16) ? 15 - tri->step : tri->step - 16;
+}
+
+static bool noise_muted(const apu_noise_t *noise) {
+    return noise->length == 0 || VOLUME(noise->regs[0], noise->env) == 0;
+}
+
+static uint8_t noise_level(const apu_noise_t *noise) {
+    if (noise_muted(noise) || (noise->shift & 1)) {
+        return 0;
+    }
+    return VOLUME(noise->regs[0], noise->env);
+}
+
+// levels after a register write or sequencer step
+static void update_outputs(nes_t *nes) {
+    apu_t *apu = &nes->apu;
+    for (int ch = 0; ch < 2; ch++) {
+        set_out(nes, apu->cycle, &apu->pulse[ch].out, pulse_level(&apu->pulse[ch], ch), PULSE_WEIGHT);
+    }
+    set_out(nes, apu->cycle, &apu->noise.out, noise_level(&apu->noise), NOISE_WEIGHT);
+}
+
+// The channel runners step a timer from output change to output change
+// within [apu->cycle, to). Without sound output only the dmc has state the
+// cpu can observe, the others are left alone.
+
+static void pulse_run(nes_t *nes, int ch, uint64_t to) {
+    apu_pulse_t *p = &nes->apu.pulse[ch];
+    if (nes->audio == NULL || pulse_muted(p, ch)) {
+        return;
+    }
+    const uint32_t period = (p->period + 1) * 2;
+    uint64_t t = nes->apu.cycle;
+    while (to - t >= p->timer) {
+        t += p->timer;
+        p->timer = period;
+        p->step = (p->step + 1) & 7;
+        set_out(nes, t, &p->out, pulse_level(p, ch), PULSE_WEIGHT);
+    }
+    p->timer -= to - t;
+}
+
+static void triangle_run(nes_t *nes, uint64_t to) {
+    apu_triangle_t *tri = &nes->apu.triangle;
+    // ultrasonic periods are frozen instead of aliasing
+    if (nes->audio == NULL || tri->length == 0 || tri->linear == 0 || tri->period < 2) {
+        return;
+    }
+    const uint32_t period = tri->period + 1;
+    uint64_t t = nes->apu.cycle;
+    while (to - t >= tri->timer) {
+        t += tri->timer;
+        tri->timer = period;
+        tri->step = (tri->step + 1) & 31;
+        set_out(nes, t, &tri->out, triangle_level(tri), TRIANGLE_WEIGHT);
+    }
+    tri->timer -= to - t;
+}
+
+static void noise_run(nes_t *nes, uint64_t to) {
+    apu_noise_t *noise = &nes->apu.noise;
+    if (nes->audio == NULL || noise_muted(noise)) {
+        return;
+    }
+    const uint32_t period = noise_period[noise->regs[2] & 0x0f];
+    const int tap = (noise->regs[2] & 0x80) ? 6 : 1;
+    uint64_t t = nes->apu.cycle;
+    while (to - t >= noise->timer) {
+        t += noise->timer;
+        noise->timer = period;
+        uint16_t feedback = (noise->shift ^ (noise->shift >> tap)) & 1;
+        noise->shift = (noise->shift >> 1) | (feedback << 14);
+        set_out(nes, t, &noise->out, noise_level(noise), NOISE_WEIGHT);
+    }
+    noise->timer -= to - t;
+}
+
+static void dmc_restart(apu_dmc_t *dmc) {
+    dmc->addr = 0xc000 + dmc->regs[2] * 64;
+    dmc->remaining = dmc->regs[3] * 16 + 1;
+}
+
+// Fetches the next sample byte into the empty buffer. The cpu cycles the
+// fetch steals are not emulated.
+static void dmc_fetch(nes_t *nes) {
+    apu_dmc_t *dmc = &nes->apu.dmc;
+    if (dmc->buffer_full || dmc->remaining == 0) {
+        return;
+    }
+    dmc->buffer = nes_readbus(nes, dmc->addr);
+    dmc->buffer_full = true;
+    dmc->addr = (dmc->addr == 0xffff) ? 0x8000 : dmc->addr + 1;
+    if (--dmc->remaining == 0) {
+        if (dmc->regs[0] & 0x40) {
+            dmc_restart(dmc);
+        } else if (dmc->regs[0] & 0x80) {
+            dmc->irq = true;
+            nes_set_irq(nes, IRQ_DMC, true);
+        }
+    }
+}
+
+static void dmc_run(nes_t *nes, uint64_t to) {
+    apu_dmc_t *dmc = &nes->apu.dmc;
+    if (dmc->silence && !dmc->buffer_full && dmc->remaining == 0) {
+        return; // idle until $4015 starts a sample
+    }
+    const uint32_t period = dmc_period[dmc->regs[0] & 0x0f];
+    uint64_t t = nes->apu.cycle;
+    while (to - t >= dmc->timer) {
+        t += dmc->timer;
+        dmc->timer = period;
+        if (!dmc->silence) {
+            uint8_t level = dmc->out;
+            if (dmc->shift & 1) {
+                level += (level <= 125) ? 2 : 0;
+            } else {
+                level -= (level >= 2) ? 2 : 0;
+            }
+            set_out(nes, t, &dmc->out, level, DMC_WEIGHT);
+        }
+        dmc->shift >>= 1;
+        if (--dmc->bits == 0) {
+            dmc->bits = 8;
+            dmc->silence = !dmc->buffer_full;
+            dmc->shift = dmc->buffer;
+            dmc->buffer_full = false;
+            dmc_fetch(nes);
+        }
+    }
+    dmc->timer -= to - t;
+}
+
+static void envelope_clock(apu_envelope_t *env, uint8_t reg) {
+    if (env->start) {
+        env->start = false;
+        env->decay = 15;
+        env->divider = reg & 0x0f;
+    } else if (env->divider == 0) {
+        env->divider = reg & 0x0f;
+        if (env->decay) {
+            env->decay--;
+        } else if (LENGTH_HALT(reg)) {
+            env->decay = 15;
+        }
+    } else {
+        env->divider--;
+    }
+}
+
+static void quarter_frame(apu_t *apu) {
+    envelope_clock(&apu->pulse[0].env, apu->pulse[0].regs[0]);
+    envelope_clock(&apu->pulse[1].env, apu->pulse[1].regs[0]);
+    envelope_clock(&apu->noise.env, apu->noise.regs[0]);
+    apu_triangle_t *tri = &apu->triangle;
+    if (tri->linear_reload) {
+        tri->linear = tri->regs[0] & 0x7f;
+    } else if (tri->linear) {
+        tri->linear--;
+    }
+    if (!(tri->regs[0] & 0x80)) {
+        tri->linear_reload = false;
+    }
+}
+
+static void half_frame(apu_t *apu) {
+    for (int ch = 0; ch < 2; ch++) {
+        apu_pulse_t *p = &apu->pulse[ch];
+        if (p->length && !LENGTH_HALT(p->regs[0])) {
+            p->length--;
+        }
+        uint16_t target = sweep_target(p, ch);
+        if (p->sweep_divider == 0 && (p->regs[1] & 0x80) && (p->regs[1] & 7) &&
+                p->period >= 8 && target <= 0x7ff) {
+            p->period = target;
+        }
+        if (p->sweep_divider == 0 || p->sweep_reload) {
+            p->sweep_divider = (p->regs[1] >> 4) & 7;
+            p->sweep_reload = false;
+        } else {
+            p->sweep_divider--;
+        }
+    }
+    if (apu->triangle.length && !(apu->triangle.regs[0] & 0x80)) {
+        apu->triangle.length--;
+    }
+    if (apu->noise.length && !LENGTH_HALT(apu->noise.regs[0])) {
+        apu->noise.length--;
+    }
+}
+
+// runs the frame sequencer step due at apu->cycle
+static void frame_clock(nes_t *nes) {
+    apu_t *apu = &nes->apu;
+    const int last = apu->five_step ? 4 : 3;
+    switch (apu->frame_step) {
+        case 1:
+            half_frame(apu);
+            // fall through
+        case 0:
+        case 2:
+            quarter_frame(apu);
+            break;
+        case 3:
+            if (apu->five_step) {
+                break;
+            }
+            // fall through
+        case 4:
+            half_frame(apu);
+            quarter_frame(apu);
+            if (!apu->five_step && !apu->irq_inhibit) {
+                apu->frame_irq = true;
+                nes_set_irq(nes, IRQ_APU_FRAME, true);
+            }
+            break;
+    }
+    update_outputs(nes);
+    if (apu->frame_step == last) {
+        apu->frame_start += frame_cycles[apu->five_step][last + 1];
+        apu->frame_step = 0;
+    } else {
+        apu->frame_step++;
+    }
+}
+
+void apu_sync(nes_t *nes) {
+    apu_t *apu = &nes->apu;
+    const uint64_t target = nes->clock / CPU_CLOCK_DIV;
+    while (apu->cycle < target) {
+        const uint64_t next = frame_next(apu);
+        const uint64_t end = (target < next) ? target : next;
+        pulse_run(nes, 0, end);
+        pulse_run(nes, 1, end);
+        triangle_run(nes, end);
+        noise_run(nes, end);
+        dmc_run(nes, end);
+        apu->cycle = end;
+        if (end == next) {
+            frame_clock(nes);
+        }
+    }
+}
+
+// An irq can only come from the sequencer or the last dmc fetch, the
+// scheduler wakes the apu for both. The dmc estimate may be early, the
+// handler then looks again.
+static void schedule_frame(nes_t *nes) {
+    sched_add(&nes->sched, EVT_APU_FRAME, frame_next(&nes->apu) * CPU_CLOCK_DIV);
+}
+
+static void schedule_dmc(nes_t *nes) {
+    const apu_dmc_t *dmc = &nes->apu.dmc;
+    if ((dmc->regs[0] & 0xc0) != 0x80 || dmc->remaining == 0) {
+        sched_remove(&nes->sched, EVT_APU_DMC);
+        return;
+    }
+    const uint64_t period = dmc_period[dmc->regs[0] & 0x0f];
+    uint64_t cycles = dmc->timer + (dmc->bits - 1) * period + (dmc->remaining - 1) * 8 * period;
+    sched_add(&nes->sched, EVT_APU_DMC, (nes->apu.cycle + cycles) * CPU_CLOCK_DIV);
+}
+
+void apu_frame_event(nes_t *nes, uint64_t time) {
+    apu_sync(nes);
+    schedule_frame(nes);
+}
+
+void apu_dmc_event(nes_t *nes, uint64_t time) {
+    apu_sync(nes);
+    schedule_dmc(nes);
+}
+
+void apu_init(nes_t *nes) {
+    apu_t *apu = &nes->apu;
+    apu->noise.shift = 1;
+    apu->dmc.bits = 8;
+    apu->dmc.silence = true;
+    schedule_frame(nes);
+}
+
+bool apu_enable_output(nes_t *nes, int sample_rate) {
+    if (nes->audio == NULL) {
+        nes->audio = blip_create(APU_CLOCK_RATE, sample_rate);
+    }
+    apu_restore(nes);
+    return nes->audio != NULL;
+}
+
+void apu_cleanup(nes_t *nes) {
+    blip_destroy(nes->audio);
+    nes->audio = NULL;
+}
+
+void apu_restore(nes_t *nes) {
+    if (nes->audio) {
+        blip_reset(nes->audio, nes->apu.cycle);
+    }
+}
+
+int apu_read_samples(nes_t *nes, int16_t *out, int max) {
+    if (nes->audio == NULL) {
+        return 0;
+    }
+    apu_sync(nes);
+    return blip_read(nes->audio, nes->apu.cycle, out, max);
+}
+
+void apu_report_buttonpress(nes_t *nes, button_t button, bool pressed) {
+    apu_t *apu = &nes->apu;
     if (pressed) {
-        joy1 |= button;
+        apu->joy1 |= button;
+    } else {
+        apu->joy1 &= ~button;
+    }
+}
+
+static void pulse_write(apu_pulse_t *p, uint8_t reg, uint8_t dat, bool enabled) {
+    p->regs[reg] = dat;
+    switch (reg) {
+        case 1:
+            p->sweep_reload = true;
+            break;
+        case 2:
+            p->period = (p->period & 0x700) | dat;
+            break;
+        case 3:
+            p->period = (p->period & 0xff) | ((dat & 7) << 8);
+            if (enabled) {
+                p->length = length_table[dat >> 3];
+            }
+            p->step = 0;
+            p->env.start = true;
+            break;
+    }
+}
+
+static void triangle_write(apu_triangle_t *tri, uint8_t reg, uint8_t dat, bool enabled) {
+    tri->regs[reg] = dat;
+    switch (reg) {
+        case 2:
+            tri->period = (tri->period & 0x700) | dat;
+            break;
+        case 3:
+            tri->period = (tri->period & 0xff) | ((dat & 7) << 8);
+            if (enabled) {
+                tri->length = length_table[dat >> 3];
+            }
+            tri->linear_reload = true;
+            break;
+    }
+}
+
+static void noise_write(apu_noise_t *noise, uint8_t reg, uint8_t dat, bool enabled) {
+    noise->regs[reg] = dat;
+    if (reg == 3) {
+        if (enabled) {
+            noise->length = length_table[dat >> 3];
+        }
+        noise->env.start = true;
+    }
+}
+
+static void dmc_write(nes_t *nes, uint8_t reg, uint8_t dat) {
+    apu_dmc_t *dmc = &nes->apu.dmc;
+    dmc->regs[reg] = dat;
+    if (reg == 0 && !(dat & 0x80)) {
+        dmc->irq = false;
+        nes_set_irq(nes, IRQ_DMC, false);
+    } else if (reg == 1) {
+        set_out(nes, nes->apu.cycle, &dmc->out, dat & 0x7f, DMC_WEIGHT);
+    }
+}
+
+static void status_write(nes_t *nes, uint8_t dat) {
+    apu_t *apu = &nes->apu;
+    apu->enabled = dat & 0x1f;
+    if (!(dat & 0x01)) apu->pulse[0].length = 0;
+    if (!(dat & 0x02)) apu->pulse[1].length = 0;
+    if (!(dat & 0x04)) apu->triangle.length = 0;
+    if (!(dat & 0x08)) apu->noise.length = 0;
+    apu->dmc.irq = false;
+    nes_set_irq(nes, IRQ_DMC, false);
+    if (dat & 0x10) {
+        if (apu->dmc.remaining == 0) {
+            dmc_restart(&apu->dmc);
+        }
+        dmc_fetch(nes);
     } else {
-        joy1 &= ~button;
+        apu->dmc.remaining = 0;
+    }
+}
+
+static void frame_counter_write(nes_t *nes, uint8_t dat) {
+    apu_t *apu = &nes->apu;
+    apu->five_step = dat & 0x80;
+    apu->irq_inhibit = dat & 0x40;
+    if (apu->irq_inhibit) {
+        apu->frame_irq = false;
+        nes_set_irq(nes, IRQ_APU_FRAME, false);
     }
+    // the sequence restarts a few cycles after the write
+    apu->frame_start = apu->cycle + 3;
+    apu->frame_step = 0;
+    if (apu->five_step) {
+        half_frame(apu);
+        quarter_frame(apu);
+        update_outputs(nes);
+    }
+    schedule_frame(nes);
 }
 
-void apu_write(uint8_t addr, uint8_t dat) {
+void apu_write(nes_t *nes, uint8_t addr, uint8_t dat) {
+    apu_t *apu = &nes->apu;
+    if (addr != 0x16) {
+        apu_sync(nes);
+    }
     switch (addr) {
+        case 0x00 ... 0x07: {
+            int ch = addr >> 2;
+            pulse_write(&apu->pulse[ch], addr & 3, dat, apu->enabled & (1 << ch));
+            update_outputs(nes);
+            break;
+        }
+        case 0x08 ... 0x0b:
+            triangle_write(&apu->triangle, addr & 3, dat, apu->enabled & 0x04);
+            break;
+        case 0x0c ... 0x0f:
+            noise_write(&apu->noise, addr & 3, dat, apu->enabled & 0x08);
+            update_outputs(nes);
+            break;
+        case 0x10 ... 0x13:
+            dmc_write(nes, addr & 3, dat);
+            break;
         case 0x14: // OAMDMA
             break;
         case 0x15:
+            status_write(nes, dat);
+            update_outputs(nes);
             break;
         case 0x16: // Joypad #1
             dat = dat & 1;
-            if (strobe || dat) {
-                joy1shift = joy1;
-                joy2shift = joy2;
+            if (apu->strobe || dat) {
+                apu->joy1shift = apu->joy1;
+                apu->joy2shift = apu->joy2;
             }
-            strobe = dat;
+            apu->strobe = dat;
             break;
-        case 0x17: // Joypad #2
+        case 0x17: // frame counter
+            frame_counter_write(nes, dat);
             break;
         default: ;
     }
+    if (addr >= 0x10 && addr != 0x16) {
+        schedule_dmc(nes);
+    }
 }
 
-uint8_t apu_read(uint8_t addr) {
+uint8_t apu_read(nes_t *nes, uint8_t addr) {
+    apu_t *apu = &nes->apu;
     uint8_t val = 0;
     switch(addr) {
         case 0x14: // OAMDMA
             break;
         case 0x15:
+            apu_sync(nes);
+            val = (apu->pulse[0].length ? 0x01 : 0) |
+                  (apu->pulse[1].length ? 0x02 : 0) |
+                  (apu->triangle.length ? 0x04 : 0) |
+                  (apu->noise.length    ? 0x08 : 0) |
+                  (apu->dmc.remaining   ? 0x10 : 0) |
+                  (apu->frame_irq       ? 0x40 : 0) |
+                  (apu->dmc.irq         ? 0x80 : 0);
+            apu->frame_irq = false;
+            nes_set_irq(nes, IRQ_APU_FRAME, false);
             break;
         case 0x16:// Joypad #1
-            val = joy1shift & 1;
-            if (strobe == 0) {
-                joy1shift = 0x80 | (joy1shift >> 1);
+            val = apu->joy1shift & 1;
+            if (apu->strobe == 0) {
+                apu->joy1shift = 0x80 | (apu->joy1shift >> 1);
             }
             break;
         case 0x17: // Joypad #2
-            val = joy2shift & 1;
-            if (strobe == 0) {
-                joy2shift = 0x80 | (joy2shift >> 1);
+            val = apu->joy2shift & 1;
+            if (apu->strobe == 0) {
+                apu->joy2shift = 0x80 | (apu->joy2shift >> 1);
             }
             break;
         default: ;
@@ -4,6 +4,8 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+typedef struct nes_t nes_t;
+
 typedef enum {
     BUTTON_A      = 0x01,
     BUTTON_B      = 0x02,
@@ -15,9 +17,106 @@ typedef enum {
     BUTTON_RIGHT  = 0x80,
 } button_t;
 
-void apu_report_buttonpress(button_t button, bool pressed);
+// NTSC cpu clock
+#define APU_CLOCK_RATE 1789773.0
+
+typedef struct {
+    bool start;
+    uint8_t divider;
+    uint8_t decay;
+} apu_envelope_t;
+
+typedef struct {
+    uint8_t regs[4];
+    uint8_t length;
+    apu_envelope_t env;
+    uint8_t sweep_divider;
+    bool sweep_reload;
+    uint16_t period;
+    uint32_t timer; // cpu cycles to the next sequencer step
+    uint8_t step;
+    uint8_t out;
+} apu_pulse_t;
+
+typedef struct {
+    uint8_t regs[4];
+    uint8_t length;
+    uint8_t linear;
+    bool linear_reload;
+    uint16_t period;
+    uint32_t timer;
+    uint8_t step;
+    uint8_t out;
+} apu_triangle_t;
+
+typedef struct {
+    uint8_t regs[4];
+    uint8_t length;
+    apu_envelope_t env;
+    uint16_t shift;
+    uint32_t timer;
+    uint8_t out;
+} apu_noise_t;
+
+typedef struct {
+    uint8_t regs[4];
+    uint16_t addr;      // next sample byte
+    uint16_t remaining; // sample bytes left to fetch
+    uint8_t buffer;
+    bool buffer_full;
+    uint8_t shift;
+    uint8_t bits;
+    bool silence;
+    bool irq;
+    uint32_t timer;
+    uint8_t out; // 7 bit output level
+} apu_dmc_t;
+
+// Channels are not clocked cycle by cycle. apu_sync() catches them up to the
+// cpu in batches, stepping each timer from one output change to the next and
+// handing the changes to the blip buffer as band-limited steps. Register
+// writes sync first, so they take effect at their exact cpu cycle.
+typedef struct {
+    uint8_t joy1;
+    uint8_t joy2;
+    uint8_t strobe;
+    uint8_t joy1shift;
+    uint8_t joy2shift;
+
+    uint64_t cycle; // cpu cycles emulated so far, lags behind nes->clock
+    apu_pulse_t pulse[2];
+    apu_triangle_t triangle;
+    apu_noise_t noise;
+    apu_dmc_t dmc;
+    uint8_t enabled; // $4015 channel enable bits
+
+    // frame sequencer
+    bool five_step;
+    bool irq_inhibit;
+    bool frame_irq;
+    uint8_t frame_step;
+    uint64_t frame_start; // cpu cycle the current sequence started at
+} apu_t;
+
+void apu_init(nes_t *nes);
+// starts producing samples at sample_rate, NULL nes->audio leaves the
+// channels silent (only what the cpu can observe is emulated)
+bool apu_enable_output(nes_t *nes, int sample_rate);
+void apu_cleanup(nes_t *nes);
+// rebuilds derived state after the registers were loaded
+void apu_restore(nes_t *nes);
+
+void apu_report_buttonpress(nes_t *nes, button_t button, bool pressed);
+
+uint8_t apu_read(nes_t *nes, uint8_t addr);
+void apu_write(nes_t *nes, uint8_t addr, uint8_t dat);
 
-uint8_t apu_read(uint8_t addr);
-void apu_write(uint8_t addr, uint8_t dat);
+// runs the channels up to nes->clock
+void apu_sync(nes_t *nes);
+// scheduler event handlers
+void apu_frame_event(nes_t *nes, uint64_t time);
+void apu_dmc_event(nes_t *nes, uint64_t time);
+// reads up to max samples produced so far
+int apu_read_samples(nes_t *nes, int16_t *out, int max);
 
 #endif
@@ -0,0 +1,279 @@
+// Generates the synthetic benchmark ROMs used by make bench.
+//
+// usage: mkrom <cpu|memcpy|scroll|dma> out.nes
+//
+// Every image is NROM with one 16k prg bank (mirrored at $8000 and $c000)
+// and 8k of chr rom, the code is assembled here byte by byte.
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define ORG 0xc000
+
+// 6502 opcodes used below
+#define ADC_IMM  0x69
+#define ASL_A    0x0a
+#define BEQ      0xf0
+#define BIT_ABS  0x2c
+#define BNE      0xd0
+#define BPL      0x10
+#define CLC      0x18
+#define CLD      0xd8
+#define CMP_ZP   0xc5
+#define CPX_IMM  0xe0
+#define DEX      0xca
+#define DEY      0x88
+#define EOR_IMM  0x49
+#define INC_ABSX 0xfe
+#define INC_ZP   0xe6
+#define INX      0xe8
+#define INY      0xc8
+#define JMP_ABS  0x4c
+#define LDA_ABSX 0xbd
+#define LDA_IMM  0xa9
+#define LDA_ZP   0xa5
+#define LDX_IMM  0xa2
+#define LDY_IMM  0xa0
+#define PHA      0x48
+#define PLA      0x68
+#define RTI      0x40
+#define SEI      0x78
+#define STA_ABS  0x8d
+#define STA_ABSX 0x9d
+#define STA_ZP   0x85
+#define TXA      0x8a
+#define TXS      0x9a
+
+static uint8_t prg[0x4000];
+static uint8_t chr[0x2000];
+static int pc;
+
+static uint16_t here(void) {
+    return ORG + pc;
+}
+
+static void emit(int n, ...) {
+    va_list ap;
+    va_start(ap, n);
+    for (int i = 0; i < n; i++) {
+        prg[pc++] = va_arg(ap, int);
+    }
+    va_end(ap);
+}
+
+static void op(uint8_t opcode) {
+    emit(1, opcode);
+}
+
+static void op8(uint8_t opcode, uint8_t arg) {
+    emit(2, opcode, arg);
+}
+
+static void op16(uint8_t opcode, uint16_t arg) {
+    emit(3, opcode, arg & 0xff, arg >> 8);
+}
+
+static void branch(uint8_t opcode, uint16_t target) {
+    op8(opcode, (uint8_t)(target - (here() + 2)));
+}
+
+// stores an immediate value
+static void poke(uint16_t addr, uint8_t dat) {
+    op8(LDA_IMM, dat);
+    op16(STA_ABS, addr);
+}
+
+// ppu off, stack set up, two vblanks waited for
+static void reset_prologue(void) {
+    op(SEI);
+    op(CLD);
+    op8(LDX_IMM, 0xff);
+    op(TXS);
+    poke(0x2000, 0);
+    poke(0x2001, 0);
+    for (int i = 0; i < 2; i++) {
+        uint16_t wait = here();
+        op16(BIT_ABS, 0x2002);
+        branch(BPL, wait);
+    }
+}
+
+// copies 256 bytes from src to dst
+static void copy_page(uint16_t src, uint16_t dst) {
+    op8(LDX_IMM, 0);
+    uint16_t loop = here();
+    op16(LDA_ABSX, src);
+    op16(STA_ABSX, dst);
+    op(INX);
+    branch(BNE, loop);
+}
+
+// palettes, a nametable full of tiles and 64 sprites in $0200, 8 per line
+#define DATA_PALETTE 0xf000
+#define DATA_SPRITES 0xf100
+#define DATA_PAGE    0xf200
+
+static void setup_video(void) {
+    for (int i = 0; i < 32; i++) {
+        prg[DATA_PALETTE - ORG + i] = (i * 7 + 1) & 0x3f;
+    }
+    for (int i = 0; i < 64; i++) {
+        uint8_t *sprite = &prg[DATA_SPRITES - ORG + i * 4];
+        sprite[0] = 16 + (i / 8) * 24; // y
+        sprite[1] = i;                 // tile
+        sprite[2] = i & 3;             // palette
+        sprite[3] = (i % 8) * 32;      // x
+    }
+    poke(0x2006, 0x3f);
+    poke(0x2006, 0x00);
+    op8(LDX_IMM, 0);
+    uint16_t pal = here();
+    op16(LDA_ABSX, DATA_PALETTE);
+    op16(STA_ABS, 0x2007);
+    op(INX);
+    op8(CPX_IMM, 32);
+    branch(BNE, pal);
+
+    // both nametables of the vertical mirroring: tile = x, 8 pages
+    poke(0x2006, 0x20);
+    poke(0x2006, 0x00);
+    op8(LDY_IMM, 8);
+    uint16_t page = here();
+    op8(LDX_IMM, 0);
+    uint16_t tile = here();
+    op(TXA);
+    op16(STA_ABS, 0x2007);
+    op(INX);
+    branch(BNE, tile);
+    op(DEY);
+    branch(BNE, page);
+
+    copy_page(DATA_SPRITES, 0x0200);
+    poke(0x4014, 0x02);
+}
+
+static void build_cpu(uint16_t *nmi) {
+    reset_prologue();
+    // alu loop, ppu stays off
+    uint16_t loop = here();
+    op(INX);
+    op(INY);
+    op(CLC);
+    op8(ADC_IMM, 3);
+    op8(EOR_IMM, 0x5a);
+    op(ASL_A);
+    op8(STA_ZP, 0x10);
+    op(DEX);
+    op16(JMP_ABS, loop);
+    *nmi = here();
+    op(RTI);
+}
+
+static void build_memcpy(uint16_t *nmi) {
+    reset_prologue();
+    for (int i = 0; i < 256; i++) {
+        prg[DATA_PAGE - ORG + i] = i * 13;
+    }
+    // rom to ram, then ram to ram
+    uint16_t loop = here();
+    copy_page(DATA_PAGE, 0x0300);
+    copy_page(0x0300, 0x0400);
+    op16(JMP_ABS, loop);
+    *nmi = here();
+    op(RTI);
+}
+
+static void build_scroll(uint16_t *nmi) {
+    reset_prologue();
+    setup_video();
+    poke(0x2000, 0x80);
+    poke(0x2001, 0x1e);
+    uint16_t spin = here();
+    op16(JMP_ABS, spin);
+    // scroll one pixel right per frame
+    *nmi = here();
+    op(PHA);
+    op16(BIT_ABS, 0x2002);
+    op8(INC_ZP, 0x10);
+    op8(LDA_ZP, 0x10);
+    op16(STA_ABS, 0x2005);
+    poke(0x2005, 0);
+    op(PLA);
+    op(RTI);
+}
+
+static void build_dma(uint16_t *nmi) {
+    reset_prologue();
+    setup_video();
+    poke(0x2000, 0x80);
+    poke(0x2001, 0x1e);
+    // after every nmi move all sprites in the shadow oam
+    uint16_t loop = here();
+    op8(LDA_ZP, 0x11);
+    uint16_t wait = here();
+    op8(CMP_ZP, 0x11);
+    branch(BEQ, wait);
+    op8(LDX_IMM, 0);
+    uint16_t move = here();
+    op16(INC_ABSX, 0x0203);
+    op(INX);
+    op(INX);
+    op(INX);
+    op(INX);
+    branch(BNE, move);
+    op16(JMP_ABS, loop);
+    *nmi = here();
+    op(PHA);
+    poke(0x4014, 0x02);
+    op8(INC_ZP, 0x11);
+    op(PLA);
+    op(RTI);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 3) {
+        printf("usage: %s <cpu|memcpy|scroll|dma> out.nes\n", argv[0]);
+        return 1;
+    }
+    uint16_t nmi = 0;
+    uint16_t reset = here();
+    if (strcmp(argv[1], "cpu") == 0) {
+        build_cpu(&nmi);
+    } else if (strcmp(argv[1], "memcpy") == 0) {
+        build_memcpy(&nmi);
+    } else if (strcmp(argv[1], "scroll") == 0) {
+        build_scroll(&nmi);
+    } else if (strcmp(argv[1], "dma") == 0) {
+        build_dma(&nmi);
+    } else {
+        printf("ERROR: Unknown benchmark '%s'\n", argv[1]);
+        return 1;
+    }
+    uint16_t irq = here();
+    op(RTI);
+
+    // nmi, reset and irq vectors
+    uint16_t vectors[3] = { nmi, reset, irq };
+    for (int i = 0; i < 3; i++) {
+        prg[0x3ffa + i * 2] = vectors[i] & 0xff;
+        prg[0x3ffb + i * 2] = vectors[i] >> 8;
+    }
+    // every tile has some opaque pixels in both planes
+    for (int i = 0; i < 0x2000; i++) {
+        int tile = i / 16, row = i % 8;
+        chr[i] = (i & 8) ? (tile ^ (row * 29)) : ((tile * 7 + row * 13) | 0x81);
+    }
+
+    const uint8_t header[16] = { 'N', 'E', 'S', 0x1a, 1, 1, 0x01 };
+    FILE *f = fopen(argv[2], "wb");
+    if (f == NULL) {
+        printf("ERROR: Cannot write '%s'\n", argv[2]);
+        return 1;
+    }
+    fwrite(header, sizeof(header), 1, f);
+    fwrite(prg, sizeof(prg), 1, f);
+    fwrite(chr, sizeof(chr), 1, f);
+    fclose(f);
+    return 0;
+}
@@ -0,0 +1,95 @@
+#include "blip.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+// kernel width in output samples and sub-sample positions
+#define BLIP_TAPS 16
+#define BLIP_PHASES 32
+// room for a bit over 5 frames at 48 kHz
+#define BLIP_SIZE 4096
+
+struct blip_t {
+    double ratio; // samples per clock
+    double start; // sample position of buf[0]
+    float kernel[BLIP_PHASES][BLIP_TAPS];
+    float buf[BLIP_SIZE + BLIP_TAPS];
+    float sum;      // running integral
+    float dc;       // high-pass state, follows sum slowly
+    float dc_coeff;
+};
+
+static void init_kernel(blip_t *blip) {
+    const double cutoff = 0.45; // of the sample rate
+    for (int p = 0; p < BLIP_PHASES; p++) {
+        double sum = 0;
+        for (int k = 0; k < BLIP_TAPS; k++) {
+            double x = k - BLIP_TAPS / 2 + 1 - (double)p / BLIP_PHASES;
+            double sinc = (x == 0) ? 1.0 : sin(M_PI * 2 * cutoff * x) / (M_PI * 2 * cutoff * x);
+            // blackman window over [-TAPS / 2, TAPS / 2]
+            double w = 0.5 + x / BLIP_TAPS;
+            double window = 0.42 - 0.5 * cos(2 * M_PI * w) + 0.08 * cos(4 * M_PI * w);
+            blip->kernel[p][k] = sinc * window;
+            sum += blip->kernel[p][k];
+        }
+        // every step ends up at exactly its amplitude
+        for (int k = 0; k < BLIP_TAPS; k++) {
+            blip->kernel[p][k] /= sum;
+        }
+    }
+}
+
+blip_t *blip_create(double clock_rate, double sample_rate) {
+    blip_t *blip = (blip_t*)calloc(1, sizeof(blip_t));
+    if (blip == NULL) {
+        return NULL;
+    }
+    blip->ratio = sample_rate / clock_rate;
+    // one pole high-pass around 90 Hz, as on the console
+    blip->dc_coeff = 1.0 - exp(-2 * M_PI * 90 / sample_rate);
+    init_kernel(blip);
+    return blip;
+}
+
+void blip_destroy(blip_t *blip) {
+    free(blip);
+}
+
+void blip_reset(blip_t *blip, uint64_t time) {
+    memset(blip->buf, 0, sizeof(blip->buf));
+    blip->start = floor(time * blip->ratio);
+}
+
+void blip_add_delta(blip_t *blip, uint64_t time, float delta) {
+    double pos = time * blip->ratio - blip->start;
+    if (pos < 0 || pos >= BLIP_SIZE) {
+        return; // nobody reads the samples
+    }
+    int i = (int)pos;
+    const float *kernel = blip->kernel[(int)((pos - i) * BLIP_PHASES)];
+    float *dst = &blip->buf[i];
+    for (int k = 0; k < BLIP_TAPS; k++) {
+        dst[k] += kernel[k] * delta;
+    }
+}
+
+int blip_read(blip_t *blip, uint64_t now, int16_t *out, int max) {
+    double avail = floor(now * blip->ratio - blip->start);
+    int n = avail < max ? (int)avail : max;
+    if (n <= 0) {
+        return 0;
+    }
+    if (n > BLIP_SIZE) {
+        n = BLIP_SIZE;
+    }
+    for (int i = 0; i < n; i++) {
+        blip->sum += blip->buf[i];
+        blip->dc += (blip->sum - blip->dc) * blip->dc_coeff;
+        float s = (blip->sum - blip->dc) * 32767;
+        out[i] = s > 32767 ? 32767 : (s < -32768 ? -32768 : (int16_t)s);
+    }
+    memmove(blip->buf, &blip->buf[n], (BLIP_SIZE + BLIP_TAPS - n) * sizeof(float));
+    memset(&blip->buf[BLIP_SIZE + BLIP_TAPS - n], 0, n * sizeof(float));
+    blip->start += n;
+    return n;
+}
@@ -0,0 +1,23 @@
+#ifndef _BLIP_H
+#define _BLIP_H
+
+#include <stdint.h>
+
+// Band-limited synthesis buffer. Channels add amplitude steps at clock
+// times, each step is spread over a few output samples with a windowed sinc
+// kernel. Reading integrates the deltas into samples at the output rate, so
+// the buffer resamples as a side effect.
+
+typedef struct blip_t blip_t;
+
+blip_t *blip_create(double clock_rate, double sample_rate);
+void blip_destroy(blip_t *blip);
+
+// forgets all pending deltas, the next sample starts at clock time
+void blip_reset(blip_t *blip, uint64_t time);
+// adds an amplitude step of delta at clock time
+void blip_add_delta(blip_t *blip, uint64_t time, float delta);
+// reads up to max samples that are complete at clock time now
+int blip_read(blip_t *blip, uint64_t now, int16_t *out, int max);
+
+#endif
@@ -0,0 +1,407 @@
+#include "capture.h"
+#include "ppu.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#if defined(__SSE2__)
+#define HAVE_SSE2
+#include <emmintrin.h>
+#endif
+
+#define CAPTURE_SLOTS 8
+#define CAPTURE_MAX_SAMPLES 4096
+// files are written in chunks of this size
+#define CAPTURE_BUFFER (1 << 20)
+
+// NTSC frame rate, 236.25 MHz / 11 / 4 / (341 * 262 dots)
+#define FPS_NUM 29531250
+#define FPS_DEN 491381
+
+#define Y_SIZE (FRAME_W * FRAME_H)
+#define C_SIZE ((FRAME_W / 2) * (FRAME_H / 2))
+
+typedef struct {
+    uint32_t pixels[FRAME_W * FRAME_H];
+    int16_t samples[CAPTURE_MAX_SAMPLES];
+    int count;
+} slot_t;
+
+typedef struct {
+    int fd; // -1: not recorded
+    const char *fn;
+    uint8_t *buf;
+    size_t used;
+    uint64_t size; // bytes written, including buffered
+} out_t;
+
+struct capture_t {
+    out_t video;
+    out_t audio;
+    int sample_rate;
+    bool failed;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    slot_t *slots;
+    uint64_t head; // frames queued
+    uint64_t done; // frames written
+    uint64_t tail; // slots released, the last written frame is kept
+    bool closing;
+
+    // writer: yuv holds the last written frame, only the rows that differ
+    // from it are converted again. y4m cannot skip repeated frames, so
+    // those are written again without converting anything.
+    uint8_t *yuv;
+    uint64_t repeats;
+};
+
+// bt.601, limited range
+static inline uint8_t rgb_y(int r, int g, int b) {
+    return ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+}
+
+// from the sums of 2x2 pixels
+static inline uint8_t rgb_u(int r, int g, int b) {
+    return ((-38 * r - 74 * g + 112 * b + 512) >> 10) + 128;
+}
+
+static inline uint8_t rgb_v(int r, int g, int b) {
+    return ((112 * r - 94 * g - 18 * b + 512) >> 10) + 128;
+}
+
+#ifdef HAVE_SSE2
+// sums of the (b, g, r, a) products in lanes 0-3 and 4-7 of lo and hi: one
+// int32 per pixel
+static inline __m128i dot4(__m128i lo, __m128i hi, __m128i coef) {
+    __m128 a = _mm_castsi128_ps(_mm_madd_epi16(lo, coef));
+    __m128 b = _mm_castsi128_ps(_mm_madd_epi16(hi, coef));
+    __m128i even = _mm_castps_si128(_mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+    __m128i odd = _mm_castps_si128(_mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+    return _mm_add_epi32(even, odd);
+}
+#endif
+
+static void luma_row(uint8_t *out, const uint32_t *row) {
+    int x = 0;
+#ifdef HAVE_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i coef = _mm_setr_epi16(25, 129, 66, 0, 25, 129, 66, 0);
+    const __m128i round = _mm_set1_epi32(128);
+    const __m128i offset = _mm_set1_epi32(16);
+    for (; x + 8 <= FRAME_W; x += 8) {
+        __m128i a = _mm_loadu_si128((const __m128i*)&row[x]);
+        __m128i b = _mm_loadu_si128((const __m128i*)&row[x + 4]);
+        __m128i ya = dot4(_mm_unpacklo_epi8(a, zero), _mm_unpackhi_epi8(a, zero), coef);
+        __m128i yb = dot4(_mm_unpacklo_epi8(b, zero), _mm_unpackhi_epi8(b, zero), coef);
+        ya = _mm_add_epi32(_mm_srai_epi32(_mm_add_epi32(ya, round), 8), offset);
+        yb = _mm_add_epi32(_mm_srai_epi32(_mm_add_epi32(yb, round), 8), offset);
+        __m128i y16 = _mm_packs_epi32(ya, yb);
+        _mm_storel_epi64((__m128i*)&out[x], _mm_packus_epi16(y16, y16));
+    }
+#endif
+    for (; x < FRAME_W; x++) {
+        uint32_t p = row[x];
+        out[x] = rgb_y((p >> 16) & 0xff, (p >> 8) & 0xff, p & 0xff);
+    }
+}
+
+// rows r0 and r1 to one row of u and v
+static void chroma_row(uint8_t *ou, uint8_t *ov, const uint32_t *r0, const uint32_t *r1) {
+    int x = 0;
+#ifdef HAVE_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ucoef = _mm_setr_epi16(112, -74, -38, 0, 112, -74, -38, 0);
+    const __m128i vcoef = _mm_setr_epi16(-18, -94, 112, 0, -18, -94, 112, 0);
+    const __m128i round = _mm_set1_epi32(512);
+    const __m128i offset = _mm_set1_epi32(128);
+    for (; x + 8 <= FRAME_W; x += 8) {
+        // 4 blocks of 2x2: rows added, then pixel pairs
+        __m128i a0 = _mm_loadu_si128((const __m128i*)&r0[x]);
+        __m128i a1 = _mm_loadu_si128((const __m128i*)&r0[x + 4]);
+        __m128i b0 = _mm_loadu_si128((const __m128i*)&r1[x]);
+        __m128i b1 = _mm_loadu_si128((const __m128i*)&r1[x + 4]);
+        __m128i p01 = _mm_add_epi16(_mm_unpacklo_epi8(a0, zero), _mm_unpacklo_epi8(b0, zero));
+        __m128i p23 = _mm_add_epi16(_mm_unpackhi_epi8(a0, zero), _mm_unpackhi_epi8(b0, zero));
+        __m128i p45 = _mm_add_epi16(_mm_unpacklo_epi8(a1, zero), _mm_unpacklo_epi8(b1, zero));
+        __m128i p67 = _mm_add_epi16(_mm_unpackhi_epi8(a1, zero), _mm_unpackhi_epi8(b1, zero));
+        __m128i blk01 = _mm_add_epi16(_mm_unpacklo_epi64(p01, p23), _mm_unpackhi_epi64(p01, p23));
+        __m128i blk23 = _mm_add_epi16(_mm_unpacklo_epi64(p45, p67), _mm_unpackhi_epi64(p45, p67));
+        __m128i u = dot4(blk01, blk23, ucoef);
+        __m128i v = dot4(blk01, blk23, vcoef);
+        u = _mm_add_epi32(_mm_srai_epi32(_mm_add_epi32(u, round), 10), offset);
+        v = _mm_add_epi32(_mm_srai_epi32(_mm_add_epi32(v, round), 10), offset);
+        __m128i uv16 = _mm_packs_epi32(u, v);
+        __m128i uv = _mm_packus_epi16(uv16, uv16);
+        uint32_t u4 = _mm_cvtsi128_si32(uv);
+        uint32_t v4 = _mm_cvtsi128_si32(_mm_srli_si128(uv, 4));
+        memcpy(&ou[x / 2], &u4, 4);
+        memcpy(&ov[x / 2], &v4, 4);
+    }
+#endif
+    for (; x < FRAME_W; x += 2) {
+        int r = 0, g = 0, b = 0;
+        const uint32_t quad[4] = { r0[x], r0[x + 1], r1[x], r1[x + 1] };
+        for (int i = 0; i < 4; i++) {
+            r += (quad[i] >> 16) & 0xff;
+            g += (quad[i] >> 8) & 0xff;
+            b += quad[i] & 0xff;
+        }
+        ou[x / 2] = rgb_u(r, g, b);
+        ov[x / 2] = rgb_v(r, g, b);
+    }
+}
+
+// Converts the rows of pixels that differ from prev into yuv, which holds
+// prev converted (NULL prev: all rows). Returns false if no row changed.
+static bool bgra_to_yuv420(uint8_t *yuv, const uint32_t *pixels, const uint32_t *prev) {
+    uint8_t *py = yuv;
+    uint8_t *pu = yuv + Y_SIZE;
+    uint8_t *pv = pu + C_SIZE;
+    bool changed[FRAME_H];
+    bool any = false;
+    for (int y = 0; y < FRAME_H; y++) {
+        const uint32_t *row = &pixels[y * FRAME_W];
+        changed[y] = prev == NULL || memcmp(row, &prev[y * FRAME_W], FRAME_W * sizeof(uint32_t)) != 0;
+        if (changed[y]) {
+            luma_row(&py[y * FRAME_W], row);
+            any = true;
+        }
+    }
+    for (int y = 0; y < FRAME_H / 2; y++) {
+        if (changed[2 * y] || changed[2 * y + 1]) {
+            const uint32_t *r0 = &pixels[2 * y * FRAME_W];
+            chroma_row(&pu[y * (FRAME_W / 2)], &pv[y * (FRAME_W / 2)], r0, r0 + FRAME_W);
+        }
+    }
+    return any;
+}
+
+static void out_flush(capture_t *cap, out_t *out) {
+    const uint8_t *p = out->buf;
+    size_t left = out->used;
+    while (left > 0 && !cap->failed) {
+        ssize_t n = write(out->fd, p, left);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            printf("ERROR: Cannot write '%s'\n", out->fn);
+            cap->failed = true;
+            break;
+        }
+        p += n;
+        left -= n;
+    }
+    out->used = 0;
+}
+
+static void out_write(capture_t *cap, out_t *out, const void *data, size_t len) {
+    out->size += len;
+    while (len > 0) {
+        size_t n = CAPTURE_BUFFER - out->used;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(out->buf + out->used, data, n);
+        out->used += n;
+        data = (const uint8_t*)data + n;
+        len -= n;
+        if (out->used == CAPTURE_BUFFER) {
+            out_flush(cap, out);
+        }
+    }
+}
+
+static bool out_open(out_t *out, const char *fn) {
+    out->fd = -1;
+    out->fn = fn;
+    if (fn == NULL) {
+        return true;
+    }
+    out->fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out->fd < 0) {
+        return false;
+    }
+    out->buf = (uint8_t*)malloc(CAPTURE_BUFFER);
+    if (out->buf == NULL) {
+        printf("ERROR: Out of memory.\n");
+        exit(1);
+    }
+    return true;
+}
+
+static void put16(uint8_t *p, uint16_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+    put16(p, v);
+    put16(p + 2, v >> 16);
+}
+
+// 16 bit mono pcm, the sizes are filled in by capture_close()
+static void wav_header(uint8_t hdr[44], int sample_rate, uint32_t data_size) {
+    memcpy(hdr, "RIFF", 4);
+    put32(hdr + 4, 36 + data_size);
+    memcpy(hdr + 8, "WAVEfmt ", 8);
+    put32(hdr + 16, 16);
+    put16(hdr + 20, 1); // pcm
+    put16(hdr + 22, 1); // channels
+    put32(hdr + 24, sample_rate);
+    put32(hdr + 28, sample_rate * 2);
+    put16(hdr + 32, 2); // block align
+    put16(hdr + 34, 16);
+    memcpy(hdr + 36, "data", 4);
+    put32(hdr + 40, data_size);
+}
+
+// prev: the frame written before, NULL for the first one
+static void write_slot(capture_t *cap, const slot_t *slot, const slot_t *prev) {
+    if (cap->video.fd >= 0) {
+        if (!bgra_to_yuv420(cap->yuv, slot->pixels, prev ? prev->pixels : NULL)) {
+            cap->repeats++;
+        }
+        out_write(cap, &cap->video, "FRAME\n", 6);
+        out_write(cap, &cap->video, cap->yuv, Y_SIZE + 2 * C_SIZE);
+    }
+    if (cap->audio.fd >= 0) {
+        out_write(cap, &cap->audio, slot->samples, slot->count * sizeof(int16_t));
+    }
+}
+
+static void *capture_writer(void *arg) {
+    capture_t *cap = (capture_t*)arg;
+    pthread_mutex_lock(&cap->lock);
+    while (1) {
+        while (cap->done == cap->head && !cap->closing) {
+            pthread_cond_wait(&cap->not_empty, &cap->lock);
+        }
+        if (cap->done == cap->head) {
+            break;
+        }
+        const slot_t *slot = &cap->slots[cap->done % CAPTURE_SLOTS];
+        const slot_t *prev = cap->done ? &cap->slots[(cap->done - 1) % CAPTURE_SLOTS] : NULL;
+        pthread_mutex_unlock(&cap->lock);
+
+        write_slot(cap, slot, prev);
+
+        pthread_mutex_lock(&cap->lock);
+        cap->done++;
+        cap->tail = cap->done - 1;
+        pthread_cond_signal(&cap->not_full);
+    }
+    pthread_mutex_unlock(&cap->lock);
+    return NULL;
+}
+
+capture_t *capture_open(const char *video_fn, const char *audio_fn, int sample_rate) {
+    capture_t *cap = (capture_t*)calloc(1, sizeof(capture_t));
+    if (cap == NULL) {
+        printf("ERROR: Out of memory.\n");
+        exit(1);
+    }
+    if (!out_open(&cap->video, video_fn) || !out_open(&cap->audio, audio_fn)) {
+        printf("ERROR: Cannot create '%s'\n", cap->video.fd < 0 && video_fn ? video_fn : audio_fn);
+        if (cap->video.fd >= 0) {
+            close(cap->video.fd);
+        }
+        free(cap->video.buf);
+        free(cap);
+        return NULL;
+    }
+    cap->slots = (slot_t*)calloc(CAPTURE_SLOTS, sizeof(slot_t));
+    cap->yuv = (uint8_t*)malloc(Y_SIZE + 2 * C_SIZE);
+    if (cap->slots == NULL || cap->yuv == NULL) {
+        printf("ERROR: Out of memory.\n");
+        exit(1);
+    }
+    cap->sample_rate = sample_rate;
+    if (cap->video.fd >= 0) {
+        char hdr[128];
+        int n = snprintf(hdr, sizeof(hdr), "YUV4MPEG2 W%d H%d F%d:%d Ip A8:7 C420jpeg\n",
+                         FRAME_W, FRAME_H, FPS_NUM, FPS_DEN);
+        out_write(cap, &cap->video, hdr, n);
+    }
+    if (cap->audio.fd >= 0) {
+        uint8_t hdr[44];
+        wav_header(hdr, sample_rate, 0);
+        out_write(cap, &cap->audio, hdr, sizeof(hdr));
+    }
+    pthread_mutex_init(&cap->lock, NULL);
+    pthread_cond_init(&cap->not_empty, NULL);
+    pthread_cond_init(&cap->not_full, NULL);
+    if (pthread_create(&cap->thread, NULL, capture_writer, cap) != 0) {
+        printf("ERROR: Cannot create the capture thread.\n");
+        exit(1);
+    }
+    return cap;
+}
+
+void capture_frame(capture_t *cap, const uint32_t *pixels, const int16_t *samples, int count) {
+    pthread_mutex_lock(&cap->lock);
+    while (cap->head - cap->tail == CAPTURE_SLOTS) {
+        pthread_cond_wait(&cap->not_full, &cap->lock);
+    }
+    slot_t *slot = &cap->slots[cap->head % CAPTURE_SLOTS];
+    pthread_mutex_unlock(&cap->lock);
+
+    if (cap->video.fd >= 0) {
+        memcpy(slot->pixels, pixels, sizeof(slot->pixels));
+    }
+    if (count > CAPTURE_MAX_SAMPLES) {
+        count = CAPTURE_MAX_SAMPLES;
+    }
+    memcpy(slot->samples, samples, count * sizeof(int16_t));
+    slot->count = count;
+
+    pthread_mutex_lock(&cap->lock);
+    cap->head++;
+    pthread_cond_signal(&cap->not_empty);
+    pthread_mutex_unlock(&cap->lock);
+}
+
+void capture_close(capture_t *cap) {
+    if (cap == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&cap->lock);
+    cap->closing = true;
+    pthread_cond_signal(&cap->not_empty);
+    pthread_mutex_unlock(&cap->lock);
+    pthread_join(cap->thread, NULL);
+
+    if (cap->video.fd >= 0) {
+        out_flush(cap, &cap->video);
+        close(cap->video.fd);
+        printf("capture: %llu frames (%llu repeated) written to %s\n",
+               (unsigned long long)cap->head, (unsigned long long)cap->repeats, cap->video.fn);
+    }
+    if (cap->audio.fd >= 0) {
+        out_flush(cap, &cap->audio);
+        uint8_t hdr[44];
+        wav_header(hdr, cap->sample_rate, cap->audio.size - sizeof(hdr));
+        if (pwrite(cap->audio.fd, hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+            printf("ERROR: Cannot write '%s'\n", cap->audio.fn);
+        }
+        close(cap->audio.fd);
+        printf("capture: %llu samples written to %s\n",
+               (unsigned long long)(cap->audio.size - sizeof(hdr)) / 2, cap->audio.fn);
+    }
+    pthread_cond_destroy(&cap->not_full);
+    pthread_cond_destroy(&cap->not_empty);
+    pthread_mutex_destroy(&cap->lock);
+    free(cap->video.buf);
+    free(cap->audio.buf);
+    free(cap->slots);
+    free(cap->yuv);
+    free(cap);
+}
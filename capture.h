@@ -0,0 +1,20 @@
+#ifndef _CAPTURE_H
+#define _CAPTURE_H
+
+#include <stdint.h>
+
+// Records a session to disk: the picture as y4m (yuv 4:2:0, 8:7 pixels) and
+// the sound as 16 bit mono wav. capture_frame() only copies into a bounded
+// queue, a writer thread converts and writes with large sequential writes.
+// A full queue (disk too slow) blocks the caller, frames are never dropped.
+
+typedef struct capture_t capture_t;
+
+// either file name may be NULL, NULL if a file cannot be created
+capture_t *capture_open(const char *video_fn, const char *audio_fn, int sample_rate);
+// one emulated frame: its bgra pixels and the count samples it produced
+void capture_frame(capture_t *cap, const uint32_t *pixels, const int16_t *samples, int count);
+// writes what is queued, finishes the files and frees cap
+void capture_close(capture_t *cap);
+
+#endif
@@ -1,138 +1,583 @@
 #include "cartridge.h"
+#include "nes.h"
+#include "crc32.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-#define NT_MIRROR_H (!cartridge.header.Vh)
-#define NT_MIRROR_V (cartridge.header.Vh)
+#define NT_MIRROR_V (cartridge->header.Vh)
 
-cartridge_t cartridge = { 0 };
+// spread[b] has bit (7-i) of b in byte i, spread_flipped[b] has bit i in byte i
+static uint64_t spread[256];
+static uint64_t spread_flipped[256];
 
-static uint8_t mapper0_ppu_read(uint16_t addr) {
-    extern uint8_t vram[0x4000];
+static void init_spread(void) {
+    for (int b = 0; b < 256; b++) {
+        uint64_t v = 0, f = 0;
+        for (int i = 0; i < 8; i++) {
+            v |= (uint64_t)((b >> (7 - i)) & 1) << (8 * i);
+            f |= (uint64_t)((b >> i) & 1) << (8 * i);
+        }
+        spread[b] = v;
+        spread_flipped[b] = f;
+    }
+}
+
+// decodes the row of the tile at chr offset addr
+static void decode_chr_row(cartridge_t *cartridge, uint32_t addr) {
+    uint32_t base = addr & ~0xfu;
+    uint32_t row = addr & 7;
+    uint8_t lo = cartridge->rom_chr8k[base + row];
+    uint8_t hi = cartridge->rom_chr8k[base + row + 8];
+    uint32_t idx = (base >> 1) | row;
+    cartridge->chr_rows[idx] = spread[lo] | (spread[hi] << 1);
+    cartridge->chr_rows_flipped[idx] = spread_flipped[lo] | (spread_flipped[hi] << 1);
+}
+
+static void decode_chr(cartridge_t *cartridge) {
+    for (uint32_t addr = 0; addr < cartridge->chr_size; addr += 16) {
+        for (uint32_t row = 0; row < 8; row++) {
+            decode_chr_row(cartridge, addr + row);
+        }
+    }
+}
+
+// The decoded rows of CHR-ROM never change and take 8 times the rom size,
+// so consoles running the same rom (by crc and sizes) share them.
+typedef struct chr_cache_t {
+    uint32_t crc32;
+    uint32_t prg_size;
+    uint32_t chr_size;
+    int refs;
+    uint64_t *rows;
+    uint64_t *rows_flipped;
+    struct chr_cache_t *next;
+} chr_cache_t;
+
+static chr_cache_t *chr_caches = NULL;
+static pthread_mutex_t chr_caches_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void build_chr_cache(cartridge_t *cartridge) {
+    pthread_mutex_lock(&chr_caches_lock);
+    if (spread[1] == 0) {
+        init_spread();
+    }
+    if (!cartridge->chr_ram) {
+        for (chr_cache_t *c = chr_caches; c; c = c->next) {
+            if (c->crc32 == cartridge->crc32 && c->prg_size == cartridge->prg_size && c->chr_size == cartridge->chr_size) {
+                c->refs++;
+                cartridge->chr_cache = c;
+                cartridge->chr_rows = c->rows;
+                cartridge->chr_rows_flipped = c->rows_flipped;
+                pthread_mutex_unlock(&chr_caches_lock);
+                return;
+            }
+        }
+    }
+    size_t rows = cartridge->chr_size / 2;
+    cartridge->chr_rows = (uint64_t*)malloc(rows * sizeof(uint64_t));
+    cartridge->chr_rows_flipped = (uint64_t*)malloc(rows * sizeof(uint64_t));
+    if (cartridge->chr_rows == NULL || cartridge->chr_rows_flipped == NULL) {
+        printf("ERROR: Out of memory.\n");
+        exit(1);
+    }
+    decode_chr(cartridge);
+    if (!cartridge->chr_ram) {
+        chr_cache_t *c = (chr_cache_t*)calloc(1, sizeof(chr_cache_t));
+        if (c) {
+            c->crc32 = cartridge->crc32;
+            c->prg_size = cartridge->prg_size;
+            c->chr_size = cartridge->chr_size;
+            c->refs = 1;
+            c->rows = cartridge->chr_rows;
+            c->rows_flipped = cartridge->chr_rows_flipped;
+            c->next = chr_caches;
+            chr_caches = c;
+            cartridge->chr_cache = c;
+        }
+    }
+    pthread_mutex_unlock(&chr_caches_lock);
+}
+
+static void release_chr_cache(cartridge_t *cartridge) {
+    chr_cache_t *c = cartridge->chr_cache;
+    if (c == NULL) {
+        free(cartridge->chr_rows);
+        free(cartridge->chr_rows_flipped);
+        return;
+    }
+    pthread_mutex_lock(&chr_caches_lock);
+    if (--c->refs == 0) {
+        chr_cache_t **p = &chr_caches;
+        while (*p != c) {
+            p = &(*p)->next;
+        }
+        *p = c->next;
+        free(c->rows);
+        free(c->rows_flipped);
+        free(c);
+    }
+    pthread_mutex_unlock(&chr_caches_lock);
+}
+
+// Bank switching remaps pointers only: prg banks go straight into the cpu
+// page table, chr banks are offsets into chr rom and the row cache.
+// Bank numbers wrap at the rom size, negative numbers count from the end.
+static int wrap_bank(int bank, int count) {
+    bank %= count;
+    return bank < 0 ? bank + count : bank;
+}
+
+static void set_prg8k(nes_t *nes, int slot, int bank) {
+    cartridge_t *cartridge = &nes->cartridge;
+    bank = wrap_bank(bank, cartridge->prg_size / 0x2000);
+    cartridge->prg_bank[slot] = cartridge->rom_prg16k + bank * 0x2000;
+    nes_map_cpu(nes, 0x80 + slot * 0x20, 0x20, cartridge->prg_bank[slot], NULL);
+}
+
+static void set_prg16k(nes_t *nes, int slot, int bank) {
+    bank = wrap_bank(bank, nes->cartridge.prg_size / 0x4000);
+    set_prg8k(nes, slot * 2, bank * 2);
+    set_prg8k(nes, slot * 2 + 1, bank * 2 + 1);
+}
+
+static void set_chr1k(nes_t *nes, int slot, int bank) {
+    cartridge_t *cartridge = &nes->cartridge;
+    bank = wrap_bank(bank, cartridge->chr_size / 0x400);
+    cartridge->chr_offset[slot] = bank * 0x400;
+    cartridge->chr_bank[slot] = cartridge->rom_chr8k + bank * 0x400;
+}
+
+static void set_chr4k(nes_t *nes, int slot, int bank) {
+    for (int i = 0; i < 4; i++) {
+        set_chr1k(nes, slot * 4 + i, bank * 4 + i);
+    }
+}
+
+void cartridge_set_mirroring(nes_t *nes, mirroring_t mirroring) {
+    // ciram page of $2000, $2400, $2800 and $2c00
+    static const uint8_t pages[][4] = {
+        [MIRROR_HORIZONTAL]  = { 0, 0, 1, 1 },
+        [MIRROR_VERTICAL]    = { 0, 1, 0, 1 },
+        [MIRROR_SINGLE_LOW]  = { 0, 0, 0, 0 },
+        [MIRROR_SINGLE_HIGH] = { 1, 1, 1, 1 },
+        [MIRROR_FOUR_SCREEN] = { 0, 1, 2, 3 },
+    };
+    cartridge_t *cartridge = &nes->cartridge;
+    cartridge->mirroring = mirroring;
+    for (int i = 0; i < 4; i++) {
+        cartridge->nametable[i] = &nes->ppu.ciram[pages[mirroring][i] * 0x400];
+    }
+}
+
+// entry 0 of every palette reads and writes the backdrop color
+#define PALETTE_INDEX(addr) (((addr) % 4) ? ((addr) & 0x1f) : 0)
+
+static uint8_t generic_ppu_read(nes_t *nes, uint16_t addr) {
+    cartridge_t *cartridge = &nes->cartridge;
     uint8_t val = 0;
     switch(addr) {
-        case 0x0000 ... 0x1fff: // pattern table 1+2 ROM
-            val = cartridge.rom_chr8k[addr];
-            break;
-        case 0x2000 ... 0x2fff: // nametable 0-3
-            if (NT_MIRROR_V) { // $2000 = $2800, $2400 = $2C00
-                addr &= ~0x0800;
-            } else if (NT_MIRROR_H) { // $2000 = $2400, $2800 = $2C00
-                addr &= ~0x0400;
-            }
-            val = vram[addr];
+        case 0x0000 ... 0x1fff: // pattern table 1+2
+            val = cartridge->chr_bank[addr >> 10][addr & 0x3ff];
+            break;
+        case 0x2000 ... 0x3eff: // nametable 0-3, $3000-$3eff mirrors $2000-$2eff
+            val = cartridge_nt_read(cartridge, addr);
             break;
         case 0x3f00 ... 0x3fff: // palette RAM
-            if((addr%4) == 0) {
-                addr = 0x3f00;
-            } else {
-                addr &= 0xff1f;
-            }
-            val = vram[addr];
+            val = nes->ppu.palette_ram[PALETTE_INDEX(addr)];
             break;
         default: assert(1);
     }
     return val;
 }
 
-static void mapper0_ppu_write(uint16_t addr, uint8_t dat) {
-    extern uint8_t vram[0x4000];
+static void generic_ppu_write(nes_t *nes, uint16_t addr, uint8_t dat) {
+    cartridge_t *cartridge = &nes->cartridge;
     switch(addr) {
-        case 0x0000 ... 0x1fff: // pattern table 1+2 ROM
-            break;
-        case 0x2000 ... 0x2fff: // nametable 0-3
-            if (NT_MIRROR_V) { // $2000 = $2800, $2400 = $2C00
-                addr &= ~0x0800;
-            } else if (NT_MIRROR_H) { // $2000 = $2400, $2800 = $2C00
-                addr &= ~0x0400;
+        case 0x0000 ... 0x1fff: // pattern table 1+2
+            if (cartridge->chr_ram) {
+                uint32_t offset = cartridge->chr_offset[addr >> 10] | (addr & 0x3ff);
+                cartridge->rom_chr8k[offset] = dat;
+                decode_chr_row(cartridge, offset);
             }
-            vram[addr] = dat;
+            break;
+        case 0x2000 ... 0x3eff: // nametable 0-3
+            cartridge->nametable[(addr >> 10) & 3][addr & 0x3ff] = dat;
             break;
         case 0x3f00 ... 0x3fff: // palette RAM
-            if((addr%4) == 0) {
-                addr = 0x3f00;
-            } else {
-                addr &= 0xff1f;
-            }
-            vram[addr] = dat;
+            nes->ppu.palette_ram[PALETTE_INDEX(addr)] = dat;
             break;
         default: assert(1);
     }
 }
 
-static void mapper0_cpu_write(uint16_t addr, uint8_t dat) {
-    switch(addr) {
-        case 0x8000 ... 0xffff:
+// prg rom and prg ram are read through the cpu page table, only the
+// unmapped expansion area $4020-$5fff ends up here
+static uint8_t generic_cpu_read(nes_t *nes, uint16_t addr) {
+    return 0;
+}
+
+// mapper 0: NROM, no registers
+static void mapper0_cpu_write(nes_t *nes, uint16_t addr, uint8_t dat) {
+}
+
+static void mapper0_update(nes_t *nes) {
+    // a single 16k bank is mirrored at $c000
+    set_prg16k(nes, 0, 0);
+    set_prg16k(nes, 1, -1);
+    set_chr4k(nes, 0, 0);
+    set_chr4k(nes, 1, 1);
+}
+
+// mapper 1: MMC1, registers are loaded serially, one bit per write
+static void mapper1_update(nes_t *nes) {
+    cartridge_t *cartridge = &nes->cartridge;
+    const mmc1_t *mmc1 = &cartridge->regs.mmc1;
+    static const mirroring_t mirroring[4] = {
+        MIRROR_SINGLE_LOW, MIRROR_SINGLE_HIGH, MIRROR_VERTICAL, MIRROR_HORIZONTAL
+    };
+    cartridge_set_mirroring(nes, mirroring[mmc1->control & 3]);
+    // SUROM: chr register bit 4 selects the 256k half of 512k prg rom
+    int outer = (cartridge->prg_size > 0x40000) ? (mmc1->chr0 & 0x10) : 0;
+    int prg = outer | (mmc1->prg & 0x0f);
+    switch ((mmc1->control >> 2) & 3) {
+        case 0:
+        case 1: // 32k at $8000
+            set_prg16k(nes, 0, prg & ~1);
+            set_prg16k(nes, 1, prg | 1);
+            break;
+        case 2: // first bank fixed at $8000
+            set_prg16k(nes, 0, outer);
+            set_prg16k(nes, 1, prg);
             break;
-        default: 
-            assert(1);
+        case 3: // last bank fixed at $c000
+            set_prg16k(nes, 0, prg);
+            set_prg16k(nes, 1, outer | 0x0f);
+            break;
+    }
+    if (mmc1->control & 0x10) { // two 4k chr banks
+        set_chr4k(nes, 0, mmc1->chr0);
+        set_chr4k(nes, 1, mmc1->chr1);
+    } else { // one 8k chr bank
+        set_chr4k(nes, 0, mmc1->chr0 & ~1);
+        set_chr4k(nes, 1, mmc1->chr0 | 1);
     }
 }
 
-static uint8_t mapper0_cpu_read(uint16_t addr) {
-    uint8_t dat = 0;
-    switch(addr) {
-        case 0x8000 ... 0xbfff:
-            dat = cartridge.rom_prg16k[addr - 0x8000];
+static void mapper1_cpu_write(nes_t *nes, uint16_t addr, uint8_t dat) {
+    mmc1_t *mmc1 = &nes->cartridge.regs.mmc1;
+    if (addr < 0x8000) {
+        return;
+    }
+    if (dat & 0x80) {
+        // reset shift register, fix last prg bank
+        mmc1->shift = 0x10;
+        mmc1->control |= 0x0c;
+    } else {
+        bool done = mmc1->shift & 1;
+        mmc1->shift = (mmc1->shift >> 1) | ((dat & 1) << 4);
+        if (!done) {
+            return;
+        }
+        switch ((addr >> 13) & 3) {
+            case 0: mmc1->control = mmc1->shift; break;
+            case 1: mmc1->chr0 = mmc1->shift; break;
+            case 2: mmc1->chr1 = mmc1->shift; break;
+            case 3: mmc1->prg = mmc1->shift; break;
+        }
+        mmc1->shift = 0x10;
+    }
+    mapper1_update(nes);
+}
+
+// mapper 2: UxROM, 16k prg bank at $8000, last bank fixed at $c000
+static void mapper2_update(nes_t *nes) {
+    set_prg16k(nes, 0, nes->cartridge.regs.bank);
+    set_prg16k(nes, 1, -1);
+    set_chr4k(nes, 0, 0);
+    set_chr4k(nes, 1, 1);
+}
+
+static void mapper2_cpu_write(nes_t *nes, uint16_t addr, uint8_t dat) {
+    if (addr >= 0x8000) {
+        nes->cartridge.regs.bank = dat;
+        mapper2_update(nes);
+    }
+}
+
+// mapper 3: CNROM, 8k chr bank
+static void mapper3_update(nes_t *nes) {
+    set_prg16k(nes, 0, 0);
+    set_prg16k(nes, 1, -1);
+    set_chr4k(nes, 0, nes->cartridge.regs.bank * 2);
+    set_chr4k(nes, 1, nes->cartridge.regs.bank * 2 + 1);
+}
+
+static void mapper3_cpu_write(nes_t *nes, uint16_t addr, uint8_t dat) {
+    if (addr >= 0x8000) {
+        nes->cartridge.regs.bank = dat;
+        mapper3_update(nes);
+    }
+}
+
+// mapper 4: MMC3, 8k prg banks, 1k/2k chr banks and a scanline irq
+// counter clocked by ppu address line a12
+static void mapper4_update(nes_t *nes) {
+    const mmc3_t *mmc3 = &nes->cartridge.regs.mmc3;
+    const uint8_t *bank = mmc3->bank;
+    if (mmc3->bank_select & 0x40) { // $8000 fixed to second last bank
+        set_prg8k(nes, 0, -2);
+        set_prg8k(nes, 2, bank[6]);
+    } else { // $c000 fixed to second last bank
+        set_prg8k(nes, 0, bank[6]);
+        set_prg8k(nes, 2, -2);
+    }
+    set_prg8k(nes, 1, bank[7]);
+    set_prg8k(nes, 3, -1);
+    // chr a12 inversion swaps the 2k and the 1k halves
+    int inv = (mmc3->bank_select & 0x80) ? 4 : 0;
+    set_chr1k(nes, inv ^ 0, bank[0] & ~1);
+    set_chr1k(nes, inv ^ 1, bank[0] | 1);
+    set_chr1k(nes, inv ^ 2, bank[1] & ~1);
+    set_chr1k(nes, inv ^ 3, bank[1] | 1);
+    for (int i = 0; i < 4; i++) {
+        set_chr1k(nes, inv ^ (4 + i), bank[2 + i]);
+    }
+}
+
+static void mapper4_schedule(nes_t *nes) {
+    if (nes->cartridge.regs.mmc3.irq_enabled) {
+        uint64_t time = ppu_a12_rise(nes);
+        if (time != SCHED_NEVER) {
+            sched_add(&nes->sched, EVT_MAPPER_IRQ, time);
+            return;
+        }
+    }
+    sched_remove(&nes->sched, EVT_MAPPER_IRQ);
+}
+
+static void mapper4_scanline(nes_t *nes) {
+    mmc3_t *mmc3 = &nes->cartridge.regs.mmc3;
+    if (mmc3->irq_counter == 0 || mmc3->irq_reload) {
+        mmc3->irq_counter = mmc3->irq_latch;
+        mmc3->irq_reload = false;
+    } else {
+        mmc3->irq_counter--;
+    }
+    if (mmc3->irq_counter == 0 && mmc3->irq_enabled) {
+        nes_set_irq(nes, IRQ_MAPPER, true);
+    }
+}
+
+// The counter is clocked while the ppu catches up, so the ppu has to be
+// synced at every a12 rise while the irq is enabled.
+static void mapper4_event(nes_t *nes, uint64_t time) {
+    ppu_sync(nes);
+    mapper4_schedule(nes);
+}
+
+static void mapper4_cpu_write(nes_t *nes, uint16_t addr, uint8_t dat) {
+    cartridge_t *cartridge = &nes->cartridge;
+    mmc3_t *mmc3 = &cartridge->regs.mmc3;
+    switch (addr & 0xe001) {
+        case 0x8000:
+            mmc3->bank_select = dat;
+            mapper4_update(nes);
+            break;
+        case 0x8001:
+            mmc3->bank[mmc3->bank_select & 7] = dat;
+            mapper4_update(nes);
+            break;
+        case 0xa000:
+            if (cartridge->mirroring != MIRROR_FOUR_SCREEN) {
+                cartridge_set_mirroring(nes, (dat & 1) ? MIRROR_HORIZONTAL : MIRROR_VERTICAL);
+            }
+            break;
+        case 0xa001: // prg ram protect, ram is always enabled
             break;
-        case 0xC000 ... 0xffff:
-            dat = cartridge.rom_prg16k[addr - 0xc000];
+        case 0xc000:
+            mmc3->irq_latch = dat;
             break;
-        default:;
+        case 0xc001:
+            mmc3->irq_counter = 0;
+            mmc3->irq_reload = true;
+            break;
+        case 0xe000:
+            mmc3->irq_enabled = false;
+            nes_set_irq(nes, IRQ_MAPPER, false);
+            break;
+        case 0xe001:
+            mmc3->irq_enabled = true;
+            break;
+        default: ;
+    }
+    if (addr >= 0xc000) {
+        mapper4_schedule(nes);
     }
-    return dat;
 }
 
-uint8_t cartridge_ppu_read(uint16_t addr) {
-    return cartridge.mapper_ppu_read(addr % 0x4000);
+uint8_t cartridge_ppu_read(nes_t *nes, uint16_t addr) {
+    PERF_INC(nes, mapper_ppu);
+    return nes->cartridge.mapper_ppu_read(nes, addr % 0x4000);
 }
 
-void cartridge_ppu_write(uint16_t addr, uint8_t dat) {
-    cartridge.mapper_ppu_write(addr % 0x4000, dat);
+void cartridge_ppu_write(nes_t *nes, uint16_t addr, uint8_t dat) {
+    PERF_INC(nes, mapper_ppu);
+    nes->cartridge.mapper_ppu_write(nes, addr % 0x4000, dat);
 }
 
-uint8_t cartridge_cpu_read(uint16_t addr) {
-    return cartridge.mapper_cpu_read(addr);
+uint8_t cartridge_cpu_read(nes_t *nes, uint16_t addr) {
+    PERF_INC(nes, mapper_cpu);
+    return nes->cartridge.mapper_cpu_read(nes, addr);
 }
 
-void cartridge_cpu_write(uint16_t addr, uint8_t dat) {
-    cartridge.mapper_cpu_write(addr, dat);
+void cartridge_cpu_write(nes_t *nes, uint16_t addr, uint8_t dat) {
+    PERF_INC(nes, mapper_cpu);
+    if (addr >= 0x8000) {
+        // registers may switch chr banks or mirroring mid frame
+        ppu_sync(nes);
+    }
+    nes->cartridge.mapper_cpu_write(nes, addr, dat);
+}
+
+static void rom_error(const char *fn, const char *what) {
+    printf("ERROR: '%s': %s\n", fn, what);
+    exit(1);
 }
 
-void cartridge_loadROM(const char *fn) {
-    FILE *f = fopen(fn, "r");
-    if (f == NULL) {
+void cartridge_loadROM(nes_t *nes, const char *fn) {
+    cartridge_t *cartridge = &nes->cartridge;
+    int fd = open(fn, O_RDONLY);
+    if (fd < 0) {
         printf("ERROR: File not found.\n");
         exit(1);
     }
-    fread(&cartridge.header, 1, sizeof(inesheader_t), f);
-    uint8_t mapper = cartridge.header.mapperlo | ( cartridge.header.mapperhi << 4);
-    printf("16k pages prg rom: %d\n", cartridge.header.nPRGROM16k);
-    printf("8k pages chr rom: %d\n", cartridge.header.nCHRROM8k);
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(inesheader_t)) {
+        rom_error(fn, "not an iNES file");
+    }
+    const uint8_t *image = (const uint8_t*)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) {
+        rom_error(fn, "cannot map the file");
+    }
+    cartridge->image = image;
+    cartridge->image_size = st.st_size;
+    memcpy(&cartridge->header, image, sizeof(inesheader_t));
+    if (memcmp(cartridge->header.magic, "NES\x1a", 4) != 0) {
+        rom_error(fn, "not an iNES file");
+    }
+
+    // header, trainer (512 bytes, loaded to $7000), prg rom, chr rom
+    size_t offset = sizeof(inesheader_t);
+    const uint8_t *trainer = NULL;
+    if (cartridge->header.trainer) {
+        trainer = image + offset;
+        offset += 512;
+    }
+    cartridge->prg_size = 1024*16 * cartridge->header.nPRGROM16k;
+    size_t chr_rom_size = 1024*8 * cartridge->header.nCHRROM8k;
+    if (cartridge->prg_size == 0) {
+        rom_error(fn, "no prg rom");
+    }
+    if (offset + cartridge->prg_size + chr_rom_size > cartridge->image_size) {
+        printf("ERROR: '%s': %zu bytes, the header needs %zu\n", fn,
+               cartridge->image_size, offset + cartridge->prg_size + chr_rom_size);
+        exit(1);
+    }
+    cartridge->rom_prg16k = image + offset;
+    cartridge->crc32 = crc32_update(0, cartridge->rom_prg16k, cartridge->prg_size + chr_rom_size);
+
+    uint8_t mapper = cartridge->header.mapperlo | ( cartridge->header.mapperhi << 4);
+    printf("16k pages prg rom: %d\n", cartridge->header.nPRGROM16k);
+    printf("8k pages chr rom: %d\n", cartridge->header.nCHRROM8k);
     printf("mapper %d\n", mapper);
-    if( cartridge.header.four ) {
+    printf("crc32 %08x\n", cartridge->crc32);
+    if( cartridge->header.four ) {
         printf("No nametable mirroring, four-screen\n");
+        cartridge_set_mirroring(nes, MIRROR_FOUR_SCREEN);
     } else {
         printf("%s nametable mirroring\n", NT_MIRROR_V ? "Vertical" : "Horizontal");
+        cartridge_set_mirroring(nes, NT_MIRROR_V ? MIRROR_VERTICAL : MIRROR_HORIZONTAL);
     }
-    cartridge.rom_prg16k = (uint8_t*)malloc(1024*16 * cartridge.header.nPRGROM16k);
-    cartridge.rom_chr8k = (uint8_t*)malloc(1024*8 * cartridge.header.nCHRROM8k);
-    fread(cartridge.rom_prg16k, cartridge.header.nPRGROM16k, 16*1024, f);
-    fread(cartridge.rom_chr8k, cartridge.header.nCHRROM8k, 8*1024, f);
-    fclose(f);
-    if (mapper == 0) {
-        cartridge.mapper_ppu_read = mapper0_ppu_read;
-        cartridge.mapper_ppu_write = mapper0_ppu_write;
-        cartridge.mapper_cpu_read = mapper0_cpu_read;
-        cartridge.mapper_cpu_write = mapper0_cpu_write;
+    cartridge->mapper = mapper;
+    if (chr_rom_size) {
+        // only written through generic_ppu_write, which checks chr_ram
+        cartridge->chr_size = chr_rom_size;
+        cartridge->rom_chr8k = (uint8_t*)(image + offset + cartridge->prg_size);
     } else {
-        printf("ERROR: Mapper %d not supported\n", mapper);
-        exit(1);
+        // board uses CHR-RAM
+        cartridge->chr_size = 1024*8;
+        cartridge->chr_ram = true;
+        cartridge->rom_chr8k = (uint8_t*)calloc(1, cartridge->chr_size);
+    }
+    if (trainer) {
+        memcpy(cartridge->prg_ram + 0x1000, trainer, 512);
+    }
+    build_chr_cache(cartridge);
+
+    cartridge->mapper_ppu_read = generic_ppu_read;
+    cartridge->mapper_ppu_write = generic_ppu_write;
+    cartridge->mapper_cpu_read = generic_cpu_read;
+    switch (mapper) {
+        case 0:
+            cartridge->mapper_cpu_write = mapper0_cpu_write;
+            cartridge->mapper_update = mapper0_update;
+            break;
+        case 1:
+            cartridge->mapper_cpu_write = mapper1_cpu_write;
+            cartridge->mapper_update = mapper1_update;
+            cartridge->regs.mmc1.shift = 0x10;
+            cartridge->regs.mmc1.control = 0x0c;
+            break;
+        case 2:
+            cartridge->mapper_cpu_write = mapper2_cpu_write;
+            cartridge->mapper_update = mapper2_update;
+            break;
+        case 3:
+            cartridge->mapper_cpu_write = mapper3_cpu_write;
+            cartridge->mapper_update = mapper3_update;
+            break;
+        case 4:
+            cartridge->mapper_cpu_write = mapper4_cpu_write;
+            cartridge->mapper_update = mapper4_update;
+            cartridge->mapper_scanline = mapper4_scanline;
+            cartridge->mapper_event = mapper4_event;
+            break;
+        default:
+            printf("ERROR: Mapper %d not supported\n", mapper);
+            exit(1);
     }
+    // prg ram at $6000-$7fff, always enabled
+    nes_map_cpu(nes, 0x60, 0x20, cartridge->prg_ram, cartridge->prg_ram);
+    cartridge->mapper_update(nes);
 }
 
-void cartridge_cleanup(void) {
-    free(cartridge.rom_prg16k);
-    free(cartridge.rom_chr8k);
+void cartridge_load_chr_ram(nes_t *nes, const uint8_t *src) {
+    cartridge_t *cartridge = &nes->cartridge;
+    memcpy(cartridge->rom_chr8k, src, cartridge->chr_size);
+    decode_chr(cartridge);
+}
+
+void cartridge_cleanup(nes_t *nes) {
+    cartridge_t *cartridge = &nes->cartridge;
+    release_chr_cache(cartridge);
+    if (cartridge->chr_ram) {
+        free(cartridge->rom_chr8k);
+    }
+    if (cartridge->image) {
+        munmap((void*)cartridge->image, cartridge->image_size);
+    }
+    cartridge->image = NULL;
+    cartridge->rom_prg16k = NULL;
+    cartridge->rom_chr8k = NULL;
+    cartridge->chr_rows = NULL;
+    cartridge->chr_rows_flipped = NULL;
+    cartridge->chr_cache = NULL;
 }
\ No newline at end of file
@@ -2,27 +2,115 @@
 #define _CARTRIDGE_H
 
 #include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include "inesheader.h"
 
+typedef struct nes_t nes_t;
+
+typedef enum {
+    MIRROR_HORIZONTAL,
+    MIRROR_VERTICAL,
+    MIRROR_SINGLE_LOW,
+    MIRROR_SINGLE_HIGH,
+    MIRROR_FOUR_SCREEN,
+} mirroring_t;
+
+// MMC1 (mapper 1)
+typedef struct {
+    uint8_t shift; // serial port, the 1 shifted in first marks the 5th write
+    uint8_t control;
+    uint8_t chr0;
+    uint8_t chr1;
+    uint8_t prg;
+} mmc1_t;
+
+// MMC3 (mapper 4)
+typedef struct {
+    uint8_t bank_select;
+    uint8_t bank[8];
+    uint8_t irq_latch;
+    uint8_t irq_counter;
+    bool irq_reload;
+    bool irq_enabled;
+} mmc3_t;
+
 typedef struct {
     inesheader_t header;
-    uint8_t *rom_prg16k;
-    uint8_t *rom_chr8k;
-    uint8_t (*mapper_ppu_read)(uint16_t addr);
-    void (*mapper_ppu_write)(uint16_t addr, uint8_t dat);
-    uint8_t (*mapper_cpu_read)(uint16_t addr);
-    void (*mapper_cpu_write)(uint16_t addr, uint8_t dat);
+    uint8_t mapper;
+    // the rom file, mapped read only: prg and chr rom point into it, so all
+    // consoles of one rom share the page cache copy
+    const uint8_t *image;
+    size_t image_size;
+    uint32_t crc32; // of prg + chr rom, as the rom databases list it
+    const uint8_t *rom_prg16k;
+    uint32_t prg_size;
+    uint8_t *rom_chr8k; // CHR-ROM (read only), or 8k CHR-RAM if chr_ram is set
+    uint32_t chr_size;
+    bool chr_ram;
+    uint8_t prg_ram[0x2000]; // $6000-$7fff
+    // pattern table rows pre-decoded to one byte per pixel (values 0..3),
+    // indexed by tile * 8 + row, plain and horizontally flipped, used without
+    // unpacking; 8x the chr size, shared per rom unless it is CHR-RAM
+    uint64_t *chr_rows;
+    uint64_t *chr_rows_flipped;
+    struct chr_cache_t *chr_cache; // the shared entry, NULL for CHR-RAM
+
+    // Bank switching only rewrites these. prg banks are 8k at $8000, $a000,
+    // $c000 and $e000, chr banks 1k each, chr_offset is their offset into
+    // rom_chr8k (and the row cache).
+    const uint8_t *prg_bank[4];
+    const uint8_t *chr_bank[8];
+    uint32_t chr_offset[8];
+    mirroring_t mirroring;
+    // the 1k nametables at $2000, $2400, $2800 and $2c00, pointing into
+    // ppu.ciram as the mirroring says (see cartridge_set_mirroring)
+    uint8_t *nametable[4];
+
+    // mapper registers
+    union {
+        uint8_t bank; // UxROM, CNROM
+        mmc1_t mmc1;
+        mmc3_t mmc3;
+    } regs;
+
+    uint8_t (*mapper_ppu_read)(nes_t *nes, uint16_t addr);
+    void (*mapper_ppu_write)(nes_t *nes, uint16_t addr, uint8_t dat);
+    uint8_t (*mapper_cpu_read)(nes_t *nes, uint16_t addr);
+    void (*mapper_cpu_write)(nes_t *nes, uint16_t addr, uint8_t dat);
+    // recomputes the bank pointers from the mapper registers
+    void (*mapper_update)(nes_t *nes);
+    // optional: clocked by every rise of ppu address line a12 while rendering
+    void (*mapper_scanline)(nes_t *nes);
+    // optional: EVT_MAPPER_IRQ handler
+    void (*mapper_event)(nes_t *nes, uint64_t time);
 } cartridge_t;
 
-extern cartridge_t cartridge;
+// pre-decoded pattern row at ppu address addr (tile address + row 0..7)
+static inline uint64_t cartridge_chr_row(const cartridge_t *cartridge, uint16_t addr, bool flip) {
+    uint32_t offset = cartridge->chr_offset[(addr >> 10) & 7] | (addr & 0x3ff);
+    uint32_t idx = ((offset >> 1) & ~7u) | (offset & 7);
+    return flip ? cartridge->chr_rows_flipped[idx] : cartridge->chr_rows[idx];
+}
+
+// nametable byte at ppu address addr ($2000-$3eff)
+static inline uint8_t cartridge_nt_read(const cartridge_t *cartridge, uint16_t addr) {
+    return cartridge->nametable[(addr >> 10) & 3][addr & 0x3ff];
+}
+
+// repoints the nametables, mappers call this when they switch mirroring
+void cartridge_set_mirroring(nes_t *nes, mirroring_t mirroring);
 
-uint8_t cartridge_ppu_read(uint16_t addr);
-void cartridge_ppu_write(uint16_t addr, uint8_t dat);
+uint8_t cartridge_ppu_read(nes_t *nes, uint16_t addr);
+void cartridge_ppu_write(nes_t *nes, uint16_t addr, uint8_t dat);
 
-void cartridge_cpu_write(uint16_t addr, uint8_t dat);
-uint8_t cartridge_cpu_read(uint16_t addr);
+void cartridge_cpu_write(nes_t *nes, uint16_t addr, uint8_t dat);
+uint8_t cartridge_cpu_read(nes_t *nes, uint16_t addr);
 
-void cartridge_loadROM(const char *fn);
-void cartridge_cleanup(void);
+// maps and validates an iNES file, exits on errors
+void cartridge_loadROM(nes_t *nes, const char *fn);
+// replaces the CHR-RAM contents and re-decodes the row cache
+void cartridge_load_chr_ram(nes_t *nes, const uint8_t *src);
+void cartridge_cleanup(nes_t *nes);
 
 #endif
@@ -0,0 +1,11 @@
+#ifndef _CRC32_H
+#define _CRC32_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC-32 (IEEE 802.3, as zip and the rom databases use it). Start with 0 and
+// feed the previous result back in to hash data in pieces.
+uint32_t crc32_update(uint32_t crc, const void *buf, size_t len);
+
+#endif
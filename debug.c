@@ -0,0 +1,143 @@
+#include "debug.h"
+#include "nes.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+static void update_pages(nes_t *nes) {
+    for (int p = 0; p < 256; p++) {
+        // every mirror of a watched page goes through the slow path
+        int w = debug_fold(p << 8) >> 8;
+        bool rd = nes->debug && nes->debug->read_watches[w];
+        bool wr = nes->debug && nes->debug->write_watches[w];
+        nes->read_page[p] = rd ? NULL : nes->map_read[p];
+        nes->write_page[p] = wr ? NULL : nes->map_write[p];
+    }
+}
+
+// sets or clears one bit, returns +1/-1 if it flipped
+static int set_bit(uint8_t *map, uint16_t addr, bool on) {
+    uint8_t mask = 1 << (addr & 7);
+    if (!(map[addr >> 3] & mask) == !on) {
+        return 0;
+    }
+    map[addr >> 3] ^= mask;
+    return on ? 1 : -1;
+}
+
+void debug_set(nes_t *nes, uint8_t types, uint16_t addr, bool on) {
+    if (nes->debug == NULL) {
+        if (!on) {
+            return;
+        }
+        nes->debug = (debug_t*)calloc(1, sizeof(debug_t));
+        if (nes->debug == NULL) {
+            printf("ERROR: Out of memory.\n");
+            exit(1);
+        }
+    }
+    debug_t *dbg = nes->debug;
+    uint16_t ppu_addr = addr & 0x3fff;
+    addr = debug_fold(addr);
+    int n;
+    if (types & BREAK_EXEC) {
+        dbg->count += set_bit(dbg->exec, addr, on);
+    }
+    if (types & BREAK_READ) {
+        n = set_bit(dbg->read, addr, on);
+        dbg->read_watches[addr >> 8] += n;
+        dbg->count += n;
+    }
+    if (types & BREAK_WRITE) {
+        n = set_bit(dbg->write, addr, on);
+        dbg->write_watches[addr >> 8] += n;
+        dbg->count += n;
+    }
+    if (types & BREAK_CHANGE) {
+        n = set_bit(dbg->change, addr, on);
+        dbg->write_watches[addr >> 8] += n;
+        dbg->count += n;
+    }
+    if (types & BREAK_PPU_READ) {
+        dbg->count += set_bit(dbg->ppu_read, ppu_addr, on);
+    }
+    if (types & BREAK_PPU_WRITE) {
+        dbg->count += set_bit(dbg->ppu_write, ppu_addr, on);
+    }
+    if (dbg->count == 0) {
+        // the last one is gone, back to the unhooked bus
+        debug_clear(nes);
+        return;
+    }
+    update_pages(nes);
+}
+
+void debug_clear(nes_t *nes) {
+    sched_remove(&nes->sched, EVT_BREAK);
+    free(nes->debug);
+    nes->debug = NULL;
+    update_pages(nes);
+}
+
+const break_hit_t *debug_hit(const nes_t *nes) {
+    return nes->stopped && nes->debug ? &nes->debug->last : NULL;
+}
+
+void debug_describe(const break_hit_t *hit, char *out, int size) {
+    static const char *names[] = {
+        "exec", "read", "write", "change", "ppu read", "ppu write",
+    };
+    int i = 0;
+    while (i < 5 && !(hit->type & (1 << i))) {
+        i++;
+    }
+    snprintf(out, size, "%s $%04x = %02x at pc %04x", names[i], hit->addr, hit->value, hit->pc);
+}
+
+// the first hit in an instruction is reported
+static void hit(nes_t *nes, break_type_t type, uint16_t addr, uint8_t dat) {
+    debug_t *dbg = nes->debug;
+    if (dbg->hit) {
+        return;
+    }
+    dbg->hit = true;
+    dbg->last = (break_hit_t){ type, addr, dat, dbg->pc, nes->clock };
+    sched_add(&nes->sched, EVT_BREAK, nes->clock);
+}
+
+bool debug_exec(nes_t *nes) {
+    debug_t *dbg = nes->debug;
+    uint16_t pc = nes->cpu.pc;
+    dbg->pc = pc;
+    if (!DEBUG_BIT(dbg->exec, debug_fold(pc)) || dbg->resume) {
+        dbg->resume = false;
+        return false;
+    }
+    // the instruction runs when the console is started again
+    dbg->resume = true;
+    const uint8_t *page = nes->map_read[pc >> 8];
+    hit(nes, BREAK_EXEC, pc, page ? page[pc & 0xff] : 0);
+    return true;
+}
+
+void debug_read(nes_t *nes, uint16_t addr, uint8_t dat) {
+    if (DEBUG_BIT(nes->debug->read, debug_fold(addr))) {
+        hit(nes, BREAK_READ, addr, dat);
+    }
+}
+
+void debug_write(nes_t *nes, uint16_t addr, uint8_t old, uint8_t dat, bool memory) {
+    debug_t *dbg = nes->debug;
+    uint16_t at = debug_fold(addr);
+    if (DEBUG_BIT(dbg->write, at)) {
+        hit(nes, BREAK_WRITE, addr, dat);
+    } else if (memory && old != dat && DEBUG_BIT(dbg->change, at)) {
+        hit(nes, BREAK_CHANGE, addr, dat);
+    }
+}
+
+void debug_ppu(nes_t *nes, uint16_t addr, uint8_t dat, bool write) {
+    addr &= 0x3fff;
+    if (DEBUG_BIT(write ? nes->debug->ppu_write : nes->debug->ppu_read, addr)) {
+        hit(nes, write ? BREAK_PPU_WRITE : BREAK_PPU_READ, addr, dat);
+    }
+}
@@ -0,0 +1,79 @@
+#ifndef _DEBUG_H
+#define _DEBUG_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct nes_t nes_t;
+
+typedef enum {
+    BREAK_EXEC      = 0x01, // before the instruction at addr runs
+    BREAK_READ      = 0x02, // cpu reads addr
+    BREAK_WRITE     = 0x04, // cpu writes addr
+    BREAK_CHANGE    = 0x08, // cpu write changes the byte at addr (memory only)
+    BREAK_PPU_READ  = 0x10, // $2007 read of ppu address addr
+    BREAK_PPU_WRITE = 0x20, // $2007 write of ppu address addr
+} break_type_t;
+
+typedef struct {
+    break_type_t type;
+    uint16_t addr;
+    uint8_t value; // read or written, the opcode for BREAK_EXEC
+    uint16_t pc;   // instruction that caused the hit
+    uint64_t clock;
+} break_hit_t;
+
+#define DEBUG_BIT(map, addr) ((map)[(addr) >> 3] & (1 << ((addr) & 7)))
+
+// the address breakpoints at addr are kept at: internal ram repeats every 2k
+// up to $1fff, the ppu registers every 8 bytes up to $3fff
+static inline uint16_t debug_fold(uint16_t addr) {
+    if (addr < 0x2000) {
+        return addr & 0x7ff;
+    }
+    if (addr < 0x4000) {
+        return 0x2000 + (addr & 7);
+    }
+    return addr;
+}
+
+// One bit per address and kind. Cpu pages holding read or write watchpoints
+// are taken out of read_page/write_page, so memory accesses anywhere else
+// stay on the fast path and only the unmapped path tests a bit. A hit stops
+// the console at the next instruction boundary (EVT_BREAK). Ram and ppu
+// register addresses are stored folded onto their first mirror, so $0010
+// also fires for $0810 and $2002 for $3ffa.
+typedef struct debug_t {
+    uint8_t exec[0x2000];
+    uint8_t read[0x2000];
+    uint8_t write[0x2000];
+    uint8_t change[0x2000];
+    uint8_t ppu_read[0x800];
+    uint8_t ppu_write[0x800];
+    uint16_t read_watches[256]; // watched addresses per cpu page
+    uint16_t write_watches[256];
+    uint32_t count; // bits set in all maps, freed when it drops to 0
+    uint16_t pc;  // of the instruction being executed
+    bool resume;  // run the next instruction despite its execute breakpoint
+    bool hit;     // a hit is pending or was reported by the last run
+    break_hit_t last;
+} debug_t;
+
+// adds (on) or removes breakpoints of the break_type_t bits in types at addr,
+// removing the last one frees nes->debug like debug_clear
+void debug_set(nes_t *nes, uint8_t types, uint16_t addr, bool on);
+// removes all breakpoints, the bus is back to full speed
+void debug_clear(nes_t *nes);
+// the hit that stopped the last nes_run_frame/nes_step, NULL if none did
+const break_hit_t *debug_hit(const nes_t *nes);
+// "write $0010 = 05 at pc c123", for reports
+void debug_describe(const break_hit_t *hit, char *out, int size);
+
+// bus hooks, only called while nes->debug is set
+bool debug_exec(nes_t *nes); // true: stop before the instruction
+void debug_read(nes_t *nes, uint16_t addr, uint8_t dat);
+// memory: old is the byte being overwritten
+void debug_write(nes_t *nes, uint16_t addr, uint8_t old, uint8_t dat, bool memory);
+void debug_ppu(nes_t *nes, uint16_t addr, uint8_t dat, bool write);
+
+#endif
@@ -0,0 +1,316 @@
+// https://wiki.nesdev.com/w/index.php/NTSC_video
+//
+#include "filter.h"
+#include "pool.h"
+#include "nescolors.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#if defined(__SSE2__)
+#define HAVE_SSE2
+#include <emmintrin.h>
+#endif
+
+// rows per band, 16 bands per frame
+#define BAND_H 15
+#define BANDS (FRAME_H / BAND_H)
+
+typedef struct {
+    const char *name;
+    int scale_x;
+    int scale_y;
+    void (*init)(void);
+    // filters rows [y0, y1) of the frame
+    void (*rows)(filter_t *filter, int band, int y0, int y1);
+} kernel_t;
+
+struct filter_t {
+    const kernel_t *kernel;
+    pool_t *pool;
+    // current job
+    const ppu_raw_frame_t *frame;
+    uint8_t *dst;
+    int pitch;
+    // per band: rgba rows with one row/pixel of border around them
+    uint32_t *scratch;
+};
+
+#define SCRATCH_W (FRAME_W + 2)
+#define SCRATCH_H (BAND_H + 2)
+
+// nes color (6 bits) | emphasis << 6 to rgba. An emphasis bit darkens the
+// two other channels.
+static uint32_t colors[512];
+
+static void init_colors(void) {
+    for (int i = 0; i < 512; i++) {
+        uint32_t c = nescolors[i & 0x3f];
+        int emphasis = i >> 6;
+        uint32_t out = 0xff000000;
+        for (int ch = 0; ch < 3; ch++) {
+            // channels b, g, r; emphasis bits r, g, b
+            float v = (c >> (8 * ch)) & 0xff;
+            for (int e = 0; e < 3; e++) {
+                if ((emphasis & (1 << e)) && ch != 2 - e) {
+                    v *= 0.746f;
+                }
+            }
+            out |= (uint32_t)v << (8 * ch);
+        }
+        colors[i] = out;
+    }
+}
+
+// rgba of line y into row, with the edge pixels repeated on both sides
+static void resolve_row(const ppu_raw_frame_t *frame, int y, uint32_t *row) {
+    const uint8_t *src = &frame->pixels[y * FRAME_W];
+    const uint32_t *pal = &colors[frame->emphasis[y] << 6];
+    for (int x = 0; x < FRAME_W; x++) {
+        row[x + 1] = pal[src[x]];
+    }
+    row[0] = row[1];
+    row[FRAME_W + 1] = row[FRAME_W];
+}
+
+// ntsc: the ppu outputs 8 samples of a square wave per pixel, one of 12
+// phases of the color subcarrier each. The signal is decoded back to yiq
+// with a 12 sample window every 4 samples (2 output pixels per nes pixel).
+// Decoding is linear, so the contribution of every 4 sample group is a
+// table lookup: by the phase of the pixel's first sample (0, 4 or 8), the
+// pixel and which half of it, already converted to bgr.
+#define NTSC_HUE 3.75f // phase offset of the decoder, in 1/12 cycles
+#define NTSC_GROUPS (FRAME_W * 2)
+
+static float ntsc_table[3][512][2][4];
+
+static int in_color_phase(int color, int phase) {
+    return (color + phase) % 12 < 6;
+}
+
+// signal level of a pixel at a phase, 0 black, 1 white
+static float ntsc_level(int pixel, int phase) {
+    static const float levels[8] = {
+        0.228f, 0.312f, 0.552f, 0.880f, // low
+        0.616f, 0.840f, 1.100f, 1.100f, // high
+    };
+    int color = pixel & 0x0f;
+    int level = (pixel >> 4) & 3;
+    int emphasis = pixel >> 6;
+    if (color > 13) {
+        level = 1;
+    }
+    float low = levels[level];
+    float high = levels[4 + level];
+    if (color == 0) {
+        low = high;
+    }
+    if (color > 12) {
+        high = low;
+    }
+    float signal = in_color_phase(color, phase) ? high : low;
+    if (((emphasis & 1) && in_color_phase(0, phase)) ||
+        ((emphasis & 2) && in_color_phase(4, phase)) ||
+        ((emphasis & 4) && in_color_phase(8, phase))) {
+        signal *= 0.746f;
+    }
+    return (signal - levels[1]) / (levels[6] - levels[1]);
+}
+
+static void ntsc_init(void) {
+    for (int p = 0; p < 3; p++) {
+        for (int pixel = 0; pixel < 512; pixel++) {
+            for (int half = 0; half < 2; half++) {
+                float y = 0, i = 0, q = 0;
+                for (int s = 0; s < 4; s++) {
+                    int phase = p * 4 + half * 4 + s;
+                    float signal = ntsc_level(pixel, phase % 12) / 12;
+                    float angle = (float)M_PI * (phase + NTSC_HUE) / 6;
+                    y += signal;
+                    i += 2 * signal * cosf(angle);
+                    q += 2 * signal * sinf(angle);
+                }
+                float *bgr = ntsc_table[p][pixel][half];
+                bgr[0] = 255 * (y - 1.108545f * i + 1.709007f * q);
+                bgr[1] = 255 * (y - 0.274788f * i - 0.635691f * q);
+                bgr[2] = 255 * (y + 0.946882f * i + 0.623557f * q);
+                bgr[3] = 0;
+            }
+        }
+    }
+}
+
+static void ntsc_rows(filter_t *filter, int band, int y0, int y1) {
+    const ppu_raw_frame_t *frame = filter->frame;
+    // groups of the line, black on both ends
+    float groups[NTSC_GROUPS + 2][4];
+    memset(groups, 0, sizeof(groups));
+    for (int y = y0; y < y1; y++) {
+        const uint8_t *src = &frame->pixels[y * FRAME_W];
+        uint32_t *out = (uint32_t*)(filter->dst + y * filter->pitch);
+        const int emphasis = frame->emphasis[y] << 6;
+        // 341 dots of 8 samples move the phase on by 4 per line
+        int p = ((frame->phase + y * 4) % 12) / 4;
+        for (int x = 0; x < FRAME_W; x++) {
+            memcpy(groups[1 + x * 2], ntsc_table[p][src[x] | emphasis], 8 * sizeof(float));
+            p = (p + 2) % 3;
+        }
+#ifdef HAVE_SSE2
+        const __m128 alpha = _mm_set_ps(255, 0, 0, 0);
+        __m128 prev = _mm_loadu_ps(groups[0]);
+        __m128 cur = _mm_loadu_ps(groups[1]);
+        for (int k = 0; k < NTSC_GROUPS; k++) {
+            __m128 next = _mm_loadu_ps(groups[k + 2]);
+            __m128 sum = _mm_add_ps(_mm_add_ps(prev, cur), _mm_add_ps(next, alpha));
+            __m128i px = _mm_cvtps_epi32(sum);
+            px = _mm_packs_epi32(px, px);
+            px = _mm_packus_epi16(px, px);
+            out[k] = _mm_cvtsi128_si32(px);
+            prev = cur;
+            cur = next;
+        }
+#else
+        for (int k = 0; k < NTSC_GROUPS; k++) {
+            uint32_t px = 0xff000000;
+            for (int c = 0; c < 3; c++) {
+                float v = groups[k][c] + groups[k + 1][c] + groups[k + 2][c];
+                px |= (uint32_t)(v < 0 ? 0 : v > 255 ? 255 : lrintf(v)) << (8 * c);
+            }
+            out[k] = px;
+        }
+#endif
+    }
+}
+
+// scale2x: every pixel E becomes 2x2, each corner takes the color of the
+// two neighbours meeting there if they are equal and the edge is not
+// part of a line through E
+//
+//    A B C      E0 E1
+//    D E F  ->  E2 E3
+//    G H I
+static void scale2x_rows(filter_t *filter, int band, int y0, int y1) {
+    const ppu_raw_frame_t *frame = filter->frame;
+    uint32_t *rows = &filter->scratch[band * SCRATCH_W * SCRATCH_H];
+    for (int y = y0 - 1; y <= y1; y++) {
+        int src = y < 0 ? 0 : y >= FRAME_H ? FRAME_H - 1 : y;
+        resolve_row(frame, src, &rows[(y - y0 + 1) * SCRATCH_W]);
+    }
+    for (int y = y0; y < y1; y++) {
+        const uint32_t *above = &rows[(y - y0) * SCRATCH_W + 1];
+        const uint32_t *line = above + SCRATCH_W;
+        const uint32_t *below = line + SCRATCH_W;
+        uint32_t *out0 = (uint32_t*)(filter->dst + 2 * y * filter->pitch);
+        uint32_t *out1 = (uint32_t*)(filter->dst + (2 * y + 1) * filter->pitch);
+        int x = 0;
+#ifdef HAVE_SSE2
+        for (; x + 4 <= FRAME_W; x += 4) {
+            __m128i b = _mm_loadu_si128((const __m128i*)&above[x]);
+            __m128i d = _mm_loadu_si128((const __m128i*)&line[x - 1]);
+            __m128i e = _mm_loadu_si128((const __m128i*)&line[x]);
+            __m128i f = _mm_loadu_si128((const __m128i*)&line[x + 1]);
+            __m128i h = _mm_loadu_si128((const __m128i*)&below[x]);
+            // b != h && d != f
+            __m128i edge = _mm_andnot_si128(_mm_or_si128(_mm_cmpeq_epi32(b, h), _mm_cmpeq_epi32(d, f)),
+                                            _mm_set1_epi32(-1));
+            __m128i m0 = _mm_and_si128(edge, _mm_cmpeq_epi32(d, b));
+            __m128i m1 = _mm_and_si128(edge, _mm_cmpeq_epi32(b, f));
+            __m128i m2 = _mm_and_si128(edge, _mm_cmpeq_epi32(d, h));
+            __m128i m3 = _mm_and_si128(edge, _mm_cmpeq_epi32(h, f));
+            __m128i e0 = _mm_or_si128(_mm_and_si128(m0, d), _mm_andnot_si128(m0, e));
+            __m128i e1 = _mm_or_si128(_mm_and_si128(m1, f), _mm_andnot_si128(m1, e));
+            __m128i e2 = _mm_or_si128(_mm_and_si128(m2, d), _mm_andnot_si128(m2, e));
+            __m128i e3 = _mm_or_si128(_mm_and_si128(m3, f), _mm_andnot_si128(m3, e));
+            _mm_storeu_si128((__m128i*)&out0[2 * x], _mm_unpacklo_epi32(e0, e1));
+            _mm_storeu_si128((__m128i*)&out0[2 * x + 4], _mm_unpackhi_epi32(e0, e1));
+            _mm_storeu_si128((__m128i*)&out1[2 * x], _mm_unpacklo_epi32(e2, e3));
+            _mm_storeu_si128((__m128i*)&out1[2 * x + 4], _mm_unpackhi_epi32(e2, e3));
+        }
+#endif
+        for (; x < FRAME_W; x++) {
+            uint32_t b = above[x], d = line[x - 1], e = line[x], f = line[x + 1], h = below[x];
+            bool edge = b != h && d != f;
+            out0[2 * x]     = (edge && d == b) ? d : e;
+            out0[2 * x + 1] = (edge && b == f) ? f : e;
+            out1[2 * x]     = (edge && d == h) ? d : e;
+            out1[2 * x + 1] = (edge && h == f) ? f : e;
+        }
+    }
+}
+
+static const kernel_t kernels[] = {
+    { "ntsc", 2, 1, ntsc_init, ntsc_rows },
+    { "scale2x", 2, 2, NULL, scale2x_rows },
+};
+
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+static void init_tables(void) {
+    init_colors();
+    for (size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+        if (kernels[i].init) {
+            kernels[i].init();
+        }
+    }
+}
+
+filter_t *filter_create(const char *name, int nthreads) {
+    const kernel_t *kernel = NULL;
+    for (size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+        if (strcmp(kernels[i].name, name) == 0) {
+            kernel = &kernels[i];
+        }
+    }
+    if (kernel == NULL) {
+        return NULL;
+    }
+    pthread_once(&tables_once, init_tables);
+    if (nthreads <= 0) {
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+        if (nthreads < 1) {
+            nthreads = 1;
+        }
+    }
+    filter_t *filter = (filter_t*)calloc(1, sizeof(filter_t));
+    uint32_t *scratch = (uint32_t*)calloc(BANDS * SCRATCH_W * SCRATCH_H, sizeof(uint32_t));
+    if (filter == NULL || scratch == NULL) {
+        printf("ERROR: Out of memory.\n");
+        exit(1);
+    }
+    filter->kernel = kernel;
+    filter->scratch = scratch;
+    filter->pool = pool_create(nthreads);
+    return filter;
+}
+
+void filter_destroy(filter_t *filter) {
+    if (filter == NULL) {
+        return;
+    }
+    pool_destroy(filter->pool);
+    free(filter->scratch);
+    free(filter);
+}
+
+int filter_width(const filter_t *filter) {
+    return FRAME_W * filter->kernel->scale_x;
+}
+
+int filter_height(const filter_t *filter) {
+    return FRAME_H * filter->kernel->scale_y;
+}
+
+static void filter_band(void *ctx, int band) {
+    filter_t *filter = (filter_t*)ctx;
+    filter->kernel->rows(filter, band, band * BAND_H, (band + 1) * BAND_H);
+}
+
+void filter_run(filter_t *filter, const ppu_raw_frame_t *frame, uint32_t *dst, int pitch) {
+    filter->frame = frame;
+    filter->dst = (uint8_t*)dst;
+    filter->pitch = pitch;
+    pool_run(filter->pool, BANDS, filter_band, filter);
+}
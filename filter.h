@@ -0,0 +1,30 @@
+#ifndef _FILTER_H
+#define _FILTER_H
+
+#include <stdint.h>
+#include "ppu.h"
+
+// Video filters turning finished frames (ppu_raw_frame_t) into rgba pixels.
+// They run on the presenting thread and its own worker pool, so they cost no
+// emulation time. A frame is cut into row bands which are filtered
+// independently.
+//
+//   ntsc     composite video: every pixel is encoded as the ppu's square
+//            wave and decoded again, 512x240
+//   scale2x  edge directed 2x scaler (AdvMAME2x), 512x480
+
+typedef struct filter_t filter_t;
+
+// NULL for an unknown name. nthreads <= 0 leaves one core to the emulation
+// thread and uses the others.
+filter_t *filter_create(const char *name, int nthreads);
+void filter_destroy(filter_t *filter);
+
+// output size in pixels
+int filter_width(const filter_t *filter);
+int filter_height(const filter_t *filter);
+
+// filters frame into dst, pitch in bytes
+void filter_run(filter_t *filter, const ppu_raw_frame_t *frame, uint32_t *dst, int pitch);
+
+#endif
@@ -1,12 +1,21 @@
 #include "d6502.h"
 #include "instruction_table.h"
-#include "ppu.h"
-#include "apu.h"
-#include "cartridge.h"
+#include "nes.h"
 #include "inesheader.h"
+#include "rewind.h"
+#include "movie.h"
+#include "tribuf.h"
+#include "ring.h"
+#include "trace.h"
+#include "filter.h"
+#include "capture.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <signal.h>
 #include <SDL2/SDL.h>
 
 
@@ -17,21 +26,96 @@ static SDL_Window *win = NULL;
 static SDL_Renderer *ren = NULL;
 static SDL_Texture *tex = NULL;
 
-struct dma_t {
-    uint8_t page;
-    int count; // if < 0 then no dma active
-} dma = { .page = 2, .count = -1 };
+static nes_t *nes = NULL;
 
+// With a window the console runs on its own thread and hands finished frames
+// to the SDL thread through a triple buffer. Keyboard state and the flags
+// below are shared between the two.
+static tribuf_t *frames = NULL;
+static pthread_t emu_thread;
+static atomic_uchar pad1;
 
-uint8_t ram_internal[0x800];
+// NTSC frame period, 60.0988 Hz
+#define FRAME_NS 16639267L
 
-int EMULATION_END = 0;
+// Audio is handed to the SDL callback through a lock-free ring. The device
+// buffer (5.3 ms) plus the queue limit (20 ms) bound the latency, samples
+// beyond the limit are dropped.
+#define AUDIO_RATE 48000
+#define AUDIO_DEVICE_SAMPLES 256
+#define AUDIO_MAX_QUEUE 960
+static SDL_AudioDeviceID audio_dev = 0;
+static ring_t *audio_ring = NULL;
+static int audio_rate = AUDIO_RATE; // of the samples the apu produces
+
+atomic_int EMULATION_END = 0;
 uint32_t run_count = 0;
-uint16_t breakpoint = 0;
 
-uint32_t frame = 0;
-uint32_t stop_frame = 0;
-int frame_step = 0;
+_Atomic uint32_t frame = 0;
+_Atomic uint32_t stop_frame = 0;
+atomic_int frame_step = 0;
+
+// headless mode: no SDL, uncapped, stop after max_frames
+bool headless = false;
+uint32_t max_frames = 0;
+// frames the parallel consoles run between two looks at signals
+#define HEADLESS_BATCH 60
+// headless consoles run side by side on the worker pool
+int instances = 1;
+int threads = 0;
+// frames skipped per rendered one: always in headless and replay mode,
+// while Tab is held in the window (default 4 there)
+int frameskip = -1;
+atomic_bool fast_forward = false;
+
+// rewind history, held backspace steps back through it
+rewind_t *rw = NULL;
+size_t rewind_mb = 32;
+uint32_t rewind_interval = 2;
+atomic_bool rewinding = false;
+
+// input movie being recorded or played back, replay runs one headless
+movie_t *movie = NULL;
+const char *record_fn = NULL;
+const char *play_fn = NULL;
+const char *replay_fn = NULL;
+
+// performance counters (make PERF=1): a summary line every perf_interval
+// frames, a json dump at exit
+uint32_t perf_interval = 0;
+// headless and replay: throughput as json, for make bench
+const char *json_fn = NULL;
+const char *perf_json_fn = NULL;
+
+// instruction trace of the (first) console: the last trace_records
+// instructions, dumped to trace_fn at exit, on F12 and on SIGUSR1, or
+// everything streamed to trace_stream_fn
+trace_t *trace = NULL;
+uint32_t trace_records = 0;
+const char *trace_fn = "trace.bin";
+const char *trace_stream_fn = NULL;
+volatile sig_atomic_t trace_dump_requested = 0;
+
+// --filter: frames are handed over in nes colors and filtered on the
+// presenting thread, straight into the texture
+filter_t *filter = NULL;
+const char *filter_name = NULL;
+int filter_threads = 0;
+ppu_raw_frame_t raw_frame;
+
+// --capture / --capture-audio: every emulated frame and its sound are
+// written to disk by a writer thread
+capture_t *capture = NULL;
+const char *capture_fn = NULL;
+const char *capture_audio_fn = NULL;
+
+// --break [type:]addr, set on the (first) console
+#define MAX_BREAKPOINTS 64
+struct {
+    uint8_t types;
+    uint16_t addr;
+} breakpoints[MAX_BREAKPOINTS];
+int breakpoint_count = 0;
 
 int init_sdl(void) {
     if (SDL_Init(SDL_INIT_VIDEO) != 0) {
@@ -40,65 +124,110 @@ int init_sdl(void) {
     win = SDL_CreateWindow("dNES", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, FRAME_W*4, FRAME_H*4, SDL_WINDOW_SHOWN | SDL_WINDOW_ALLOW_HIGHDPI | SDL_WINDOW_RESIZABLE);
     ren = SDL_CreateRenderer(win, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
     SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "nearest");
-    tex = SDL_CreateTexture(ren, SDL_PIXELFORMAT_BGRA32, SDL_TEXTUREACCESS_STREAMING, FRAME_W, FRAME_H);
+    int w = filter ? filter_width(filter) : FRAME_W;
+    int h = filter ? filter_height(filter) : FRAME_H;
+    tex = SDL_CreateTexture(ren, SDL_PIXELFORMAT_BGRA32, SDL_TEXTUREACCESS_STREAMING, w, h);
     return 0;
 }
 
-void draw(void) {
-    SDL_UpdateTexture(tex, NULL, ppu_getFrameBuffer(), FRAME_W*4);
-    // const SDL_Rect dst = {.x = 0, .y = 0, .w = FRAME_W, .h = FRAME_H };
-    SDL_RenderCopy(ren, tex, NULL, NULL);
-    SDL_RenderPresent(ren);
- }
+static void audio_callback(void *userdata, Uint8 *stream, int len) {
+    static int16_t last = 0;
+    int16_t *out = (int16_t*)stream;
+    int n = len / sizeof(int16_t);
+    int got = ring_read(audio_ring, out, n);
+    if (got) {
+        last = out[got - 1];
+    }
+    // underrun: hold the level instead of clicking to zero
+    for (int i = got; i < n; i++) {
+        out[i] = last;
+    }
+}
 
+void init_audio(void) {
+    SDL_AudioSpec want, have;
+    if (SDL_InitSubSystem(SDL_INIT_AUDIO) != 0) {
+        printf("no audio: %s\n", SDL_GetError());
+        return;
+    }
+    SDL_zero(want);
+    want.freq = AUDIO_RATE;
+    want.format = AUDIO_S16SYS;
+    want.channels = 1;
+    want.samples = AUDIO_DEVICE_SAMPLES;
+    want.callback = audio_callback;
+    audio_ring = ring_create(4 * AUDIO_MAX_QUEUE);
+    audio_dev = SDL_OpenAudioDevice(NULL, 0, &want, &have, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE);
+    if (audio_dev == 0) {
+        printf("no audio: %s\n", SDL_GetError());
+        return;
+    }
+    apu_enable_output(nes, have.freq);
+    audio_rate = have.freq;
+    SDL_PauseAudioDevice(audio_dev, 0);
+}
 
-void writebus(uint16_t addr, uint8_t dat) {
-    switch(addr) {
-        case 0x0000 ... 0x1fff: // internal ram
-            ram_internal[addr & 0x7ff] = dat;
-            break;
-        case 0x2000 ... 0x3fff: // PPU
-            ppu_write(addr & 0x7, dat);
-            break;
-        case 0x4014:
-            dma.count = 0;
-            dma.page = dat;
-            break;
-        case 0x4000 ... 0x4013: // APU + IO
-        case 0x4015 ... 0x401f: // APU + IO
-            apu_write(addr & 0x1f, dat );
-            break;
-        case 0x6000 ... 0xffff: // cartridge
-            cartridge_cpu_write(addr, dat);
-            break;
-        default:;
+static void push_audio(void) {
+    PERF_START(start);
+    int16_t samples[4096];
+    int n = apu_read_samples(nes, samples, sizeof(samples) / sizeof(samples[0]));
+    if (capture) {
+        capture_frame(capture, ppu_getFrameBuffer(nes), samples, n);
+    }
+    if (audio_ring) {
+        int room = AUDIO_MAX_QUEUE - ring_count(audio_ring);
+        if (n > room) {
+            n = room > 0 ? room : 0;
+        }
+        ring_write(audio_ring, samples, n);
     }
+    PERF_STOP(nes, present_ns, start);
 }
 
-uint8_t readbus(uint16_t addr) {
-    switch(addr) {
-        case 0x0000 ... 0x1fff: // internal ram
-            return ram_internal[addr];
-        case 0x2000 ... 0x3fff: // PPU
-            return ppu_read(addr & 0x7);
-        case 0x4000 ... 0x401f: // APU + IO
-            return apu_read(addr & 0x1f);
-        case 0x6000 ... 0xffff: // cartridge
-            return cartridge_cpu_read(addr);
-        default: ;
+// opens the --capture files, after the audio output (if any) is set up
+static bool start_capture(void) {
+    if (capture_fn == NULL && capture_audio_fn == NULL) {
+        return true;
     }
-    return 0;
+    if (capture_audio_fn && nes->audio == NULL) {
+        apu_enable_output(nes, AUDIO_RATE);
+        audio_rate = AUDIO_RATE;
+    }
+    capture = capture_open(capture_fn, capture_audio_fn, audio_rate);
+    return capture != NULL;
 }
 
-void dma_handler(void) {
-    if (dma.count < 256) {
-        uint8_t dat = readbus(dma.page * 256 + dma.count++);
-        ppu_write(4, dat);
+// headless and replay: hands the last frame and its sound to the writer
+static void capture_step(void) {
+    if (capture == NULL) {
+        return;
+    }
+    int16_t samples[4096];
+    int n = apu_read_samples(nes, samples, sizeof(samples) / sizeof(samples[0]));
+    capture_frame(capture, ppu_getFrameBuffer(nes), samples, n);
+}
+
+// moves the newest frame into the texture
+void upload_frame(void) {
+    if (filter) {
+        void *pixels;
+        int pitch;
+        if (SDL_LockTexture(tex, NULL, &pixels, &pitch) == 0) {
+            filter_run(filter, tribuf_front(frames), pixels, pitch);
+            SDL_UnlockTexture(tex);
+        }
     } else {
-        dma.count = -1;
+        SDL_UpdateTexture(tex, NULL, tribuf_front(frames), FRAME_W*4);
     }
 }
 
+void draw(void) {
+    // const SDL_Rect dst = {.x = 0, .y = 0, .w = FRAME_W, .h = FRAME_H };
+    SDL_RenderCopy(ren, tex, NULL, NULL);
+    SDL_RenderPresent(ren);
+ }
+
+
 void print_regs(d6502_t *cpu) {
     char status[32];
     sprintf(status, "st: %02X (%c%c-%c%c%c%c%c)", cpu->st,
@@ -131,126 +260,621 @@ void onExit(void) {
     SDL_Quit();
 }
 
+static void request_trace_dump(int sig) {
+    trace_dump_requested = 1;
+}
+
+// dumps the ring if asked to, called by whoever runs the console
+static void trace_poll(void) {
+    if (trace_dump_requested == 0) {
+        return;
+    }
+    trace_dump_requested = 0;
+    if (trace == NULL || trace->stream) {
+        return;
+    }
+    if (trace_dump(trace, trace_fn)) {
+        printf("trace: %llu instructions written to %s\n", (unsigned long long)(trace->count < trace->size ? trace->count : trace->size), trace_fn);
+    } else {
+        printf("ERROR: Cannot write '%s'\n", trace_fn);
+    }
+}
+
+static void trace_exit(void) {
+    if (trace && trace->stream == NULL) {
+        trace_dump_requested = 1;
+        trace_poll();
+    }
+    trace_destroy(trace);
+    trace = NULL;
+}
+
+static bool parse_breakpoint(const char *arg) {
+    static const struct {
+        const char *name;
+        uint8_t types;
+    } kinds[] = {
+        { "exec:", BREAK_EXEC }, { "read:", BREAK_READ }, { "write:", BREAK_WRITE },
+        { "change:", BREAK_CHANGE }, { "ppuread:", BREAK_PPU_READ }, { "ppuwrite:", BREAK_PPU_WRITE },
+    };
+    if (breakpoint_count == MAX_BREAKPOINTS) {
+        return false;
+    }
+    uint8_t types = BREAK_EXEC;
+    for (size_t i = 0; i < sizeof(kinds) / sizeof(kinds[0]); i++) {
+        if (strncmp(arg, kinds[i].name, strlen(kinds[i].name)) == 0) {
+            types = kinds[i].types;
+            arg += strlen(kinds[i].name);
+        }
+    }
+    char *end;
+    unsigned long addr = strtoul(arg, &end, 0);
+    if (*arg == '\0' || *end != '\0' || addr > 0xffff) {
+        return false;
+    }
+    breakpoints[breakpoint_count].types = types;
+    breakpoints[breakpoint_count].addr = addr;
+    breakpoint_count++;
+    return true;
+}
+
+// prints the breakpoint that stopped the console, if one did
+static bool report_break(void) {
+    const break_hit_t *hit = debug_hit(nes);
+    if (hit == NULL) {
+        return false;
+    }
+    char text[64];
+    debug_describe(hit, text, sizeof(text));
+    printf("break: %s, frame %u, cycle %llu\n", text, nes->frames, (unsigned long long)(hit->clock / CPU_CLOCK_DIV));
+    return true;
+}
+
+static double elapsed_seconds(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+void print_throughput(nes_t **consoles, int count, const struct timespec *start, const char *rom) {
+    double secs = elapsed_seconds(start);
+    if (secs <= 0) {
+        secs = 1e-9;
+    }
+    uint64_t instructions = 0;
+    uint64_t ppu_dots = 0;
+    uint64_t frames = 0;
+    for (int i = 0; i < count; i++) {
+        instructions += consoles[i]->instructions;
+        ppu_dots += consoles[i]->clock;
+        frames += consoles[i]->frames;
+    }
+    printf("frames: %llu, instructions: %llu, ppu dots: %llu in %.3f s\n",
+        (unsigned long long)frames, (unsigned long long)instructions, (unsigned long long)ppu_dots, secs);
+    printf("%.1f frames/s, %.0f instructions/s, %.0f ppu dots/s\n",
+        frames / secs, instructions / secs, ppu_dots / secs);
+    if (json_fn) {
+        FILE *f = fopen(json_fn, "w");
+        if (f == NULL) {
+            printf("ERROR: Cannot write '%s'\n", json_fn);
+            return;
+        }
+        fprintf(f, "{ \"rom\": \"%s\", \"instances\": %d, \"frames\": %llu, \"instructions\": %llu, \"seconds\": %.6f, "
+            "\"instructions_per_s\": %.0f, \"frames_per_s\": %.2f, \"ns_per_frame\": %.0f }\n",
+            rom, count, (unsigned long long)frames, (unsigned long long)instructions, secs,
+            instructions / secs, frames / secs, frames ? secs * 1e9 / frames : 0.0);
+        fclose(f);
+    }
+}
+
+// prints the counter summary line, summed over the consoles, when the first
+// one has run perf_interval frames since the last line
+static void perf_frame(nes_t **consoles, int count) {
+#ifdef DNES_PERF
+    static perf_t prev;
+    static uint64_t prev_frames = 0;
+    static uint64_t prev_ns = 0;
+    uint64_t now = perf_now();
+    if (prev_ns == 0) {
+        prev_ns = now;
+    }
+    if (perf_interval == 0 || consoles[0]->perf.frames - prev_frames < perf_interval) {
+        return;
+    }
+    perf_t total = { 0 };
+    for (int i = 0; i < count; i++) {
+        perf_add(&total, &consoles[i]->perf);
+    }
+    perf_print_line(stdout, &total, &prev, (now - prev_ns) / 1e9);
+    fflush(stdout);
+    prev = total;
+    prev_frames = consoles[0]->perf.frames;
+    prev_ns = now;
+#endif
+}
+
+// writes the counters of all consoles, summed up, to perf_json_fn
+static void perf_exit(nes_t **consoles, int count, const struct timespec *start) {
+#ifdef DNES_PERF
+    if (perf_json_fn == NULL) {
+        return;
+    }
+    perf_t total = { 0 };
+    for (int i = 0; i < count; i++) {
+        perf_add(&total, &consoles[i]->perf);
+    }
+    FILE *f = strcmp(perf_json_fn, "-") ? fopen(perf_json_fn, "w") : stdout;
+    if (f == NULL) {
+        printf("ERROR: Cannot write '%s'\n", perf_json_fn);
+        return;
+    }
+    perf_write_json(f, &total, elapsed_seconds(start));
+    if (f != stdout) {
+        fclose(f);
+    }
+#endif
+}
+
+void usage(const char *prog) {
+    printf("usage: %s [--headless] [--frames N] [--instances N] [--threads N] [--rewind MB] [--rewind-interval N]\n", prog);
+    printf("       [--frameskip N] [--record FILE | --play FILE | --replay FILE]\n");
+    printf("       [--perf N] [--perf-json FILE] [--json FILE]\n");
+    printf("       [--trace N] [--trace-out FILE] [--trace-stream FILE] [--break [TYPE:]ADDR]\n");
+    printf("       [--filter NAME] [--filter-threads N] [--capture FILE] [--capture-audio FILE]\n");
+    printf("       [rom.nes]\n");
+    printf("  --headless     run without SDL window, uncapped, print throughput at exit\n");
+    printf("  --frames N     stop after N emulated frames (headless default: 600)\n");
+    printf("  --instances N  headless: run N consoles in parallel\n");
+    printf("  --threads N    headless: number of worker threads (default: one per core)\n");
+    printf("  --rewind MB    memory for the rewind history, 0 disables it (default: 32)\n");
+    printf("  --rewind-interval N  take a rewind snapshot every N frames (default: 2)\n");
+    printf("  --record FILE  record the controller input to a movie\n");
+    printf("  --play FILE    play back a movie, then continue with keyboard input\n");
+    printf("  --replay FILE  run a movie headless and uncapped, print throughput at exit\n");
+    printf("  --frameskip N  render one frame in N + 1: headless and replay always,\n");
+    printf("                 in the window while Tab fast-forwards (default: 4)\n");
+    printf("  --json FILE    headless and replay: write the throughput as json\n");
+    printf("  --perf N       print a performance counter summary every N frames\n");
+    printf("  --perf-json FILE  write the counters as json at exit ('-' for stdout)\n");
+    printf("                 (both need a build with make PERF=1)\n");
+    printf("  --trace N      keep the last N instructions, written to the --trace-out\n");
+    printf("                 file at exit, on F12 and on SIGUSR1 (see tools/tracefmt)\n");
+    printf("  --trace-out FILE  where --trace dumps go (default: trace.bin)\n");
+    printf("  --trace-stream FILE  write every instruction to FILE as it runs\n");
+    printf("  --break [TYPE:]ADDR  stop when ADDR is hit, TYPE is exec (default), read,\n");
+    printf("                 write, change (a write that changes the byte), ppuread\n");
+    printf("                 or ppuwrite (through $2007); headless runs exit with 0 on\n");
+    printf("                 a hit and 2 when --frames ran out first\n");
+    printf("  --filter NAME  video filter: none (default), ntsc or scale2x\n");
+    printf("  --filter-threads N  workers for the filter (default: cores - 1)\n");
+    printf("  --capture FILE write every frame to FILE as y4m video, all frames are\n");
+    printf("                 rendered (--frameskip and Tab skip none while capturing)\n");
+    printf("  --capture-audio FILE  write the sound to FILE as wav\n");
+}
+
+int run_headless(const char *rom) {
+    if (nes->debug || capture) {
+        // breakpoints or capture: the first console on its own, to a hit or
+        // max_frames
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        nes_set_frameskip(nes, frameskip);
+        while (nes->frames < max_frames && !nes->stopped) {
+            nes_run_frame(nes);
+            capture_step();
+            perf_frame(&nes, 1);
+            trace_poll();
+        }
+        print_throughput(&nes, 1, &start, rom);
+        perf_exit(&nes, 1, &start);
+        if (!nes->debug) {
+            return 0;
+        }
+        return report_break() ? 0 : 2;
+    }
+    nes_t **consoles = (nes_t**)calloc(instances, sizeof(nes_t*));
+    consoles[0] = nes;
+    for (int i = 1; i < instances; i++) {
+        consoles[i] = nes_create(rom);
+    }
+    for (int i = 0; i < instances; i++) {
+        nes_set_frameskip(consoles[i], frameskip);
+    }
+    pool_t *pool = pool_create(instances > 1 ? threads : 1);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    // in batches, so a SIGUSR1 trace dump does not wait for the end and
+    // --perf lines come every perf_interval frames
+    uint32_t size = perf_interval ? perf_interval : HEADLESS_BATCH;
+    perf_frame(consoles, instances); // starts the interval clock
+    for (uint32_t done = 0; done < max_frames; ) {
+        uint32_t batch = max_frames - done < size ? max_frames - done : size;
+        nes_run_parallel(pool, consoles, instances, batch);
+        done += batch;
+        perf_frame(consoles, instances);
+        trace_poll();
+    }
+    print_throughput(consoles, instances, &start, rom);
+    perf_exit(consoles, instances, &start);
+
+    pool_destroy(pool);
+    for (int i = 1; i < instances; i++) {
+        nes_destroy(consoles[i]);
+    }
+    free(consoles);
+    return 0;
+}
+
+int run_replay(const char *rom) {
+    movie = movie_play(replay_fn, nes->cartridge.crc32);
+    if (movie == NULL) {
+        return 1;
+    }
+    nes_set_frameskip(nes, frameskip);
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (movie_frame(movie, nes) && (max_frames == 0 || nes->frames < max_frames)) {
+        nes_run_frame(nes);
+        capture_step();
+        perf_frame(&nes, 1);
+        trace_poll();
+        if (report_break()) {
+            break;
+        }
+    }
+    print_throughput(&nes, 1, &start, rom);
+    perf_exit(&nes, 1, &start);
+    movie_close(movie);
+    return 0;
+}
+
+// keyboard input is picked up by the emulation thread at the next frame
+static void report_button(button_t button, bool pressed) {
+    if (pressed) {
+        atomic_fetch_or(&pad1, button);
+    } else {
+        atomic_fetch_and(&pad1, (uint8_t)~button);
+    }
+}
+
+static void publish_frame(void) {
+    PERF_START(start);
+    if (filter) {
+        memcpy(tribuf_back(frames), &raw_frame, sizeof(raw_frame));
+    } else {
+        memcpy(tribuf_back(frames), ppu_getFrameBuffer(nes), FRAME_W * FRAME_H * sizeof(uint32_t));
+    }
+    tribuf_publish(frames);
+    PERF_STOP(nes, present_ns, start);
+}
+
+// sleeps until the next frame is due, never more than a few frames behind
+static void pace(struct timespec *next) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    next->tv_nsec += FRAME_NS;
+    if (next->tv_nsec >= 1000000000L) {
+        next->tv_nsec -= 1000000000L;
+        next->tv_sec++;
+    }
+    int64_t late = (now.tv_sec - next->tv_sec) * 1000000000LL + (now.tv_nsec - next->tv_nsec);
+    if (late > 4 * FRAME_NS) {
+        *next = now;
+    }
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, next, NULL);
+}
+
+static void *emulate(void *arg) {
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while (EMULATION_END == 0) {
+        // skipped frames are neither shown nor paced
+        bool shown = true;
+        if (rw && rewinding) {
+            // the frame buffer is not part of the state, render one frame
+            // from the restored snapshot without recording it
+            rewind_step_back(rw, nes, 1);
+            nes->ppu.skip = false;
+            nes_run_frame(nes);
+            push_audio();
+            publish_frame();
+        } else if (stop_frame != frame || frame_step == 0 ) {
+            nes_set_frameskip(nes, fast_forward ? frameskip : 0);
+            shown = !nes->ppu.skip;
+            if (capture_fn) {
+                // the video gets every frame: fast-forward still neither
+                // shows nor paces them, but renders them all
+                nes->ppu.skip = false;
+            }
+            nes->apu.joy1 = pad1;
+            if (movie && !movie_frame(movie, nes)) {
+                printf("movie ended after %u frames\n", movie_frames(movie));
+                movie_close(movie);
+                movie = NULL;
+            }
+            nes_run_frame(nes);
+            push_audio();
+            if (rw) {
+                rewind_frame(rw, nes);
+            }
+            if (shown) {
+                publish_frame();
+            }
+            frame++;
+            if (report_break()) {
+                // paused, f continues to the next hit or frame end
+                stop_frame = frame;
+                frame_step = 1;
+            }
+            if (max_frames && frame >= max_frames) {
+                EMULATION_END = 1;
+            }
+        } else {
+            SDL_Delay(10);
+            clock_gettime(CLOCK_MONOTONIC, &next);
+            continue;
+        }
+        perf_frame(&nes, 1);
+        trace_poll();
+        if (shown) {
+            pace(&next);
+        }
+    }
+    return NULL;
+}
+
+void handle_events(void) {
+    SDL_Event e;
+    while (SDL_PollEvent(&e)) {
+        if (e.type == SDL_QUIT) {
+            EMULATION_END = 1;
+        }
+        if (e.type == SDL_KEYDOWN || e.type == SDL_KEYUP) {
+            switch (e.key.keysym.sym) {
+                case SDLK_UP:
+                    report_button(BUTTON_UP, e.type == SDL_KEYDOWN);
+                    break;
+                case SDLK_DOWN:
+                    report_button(BUTTON_DOWN, e.type == SDL_KEYDOWN);
+                    break;
+                case SDLK_LEFT:
+                    report_button(BUTTON_LEFT, e.type == SDL_KEYDOWN);
+                    break;
+                case SDLK_RIGHT:
+                    report_button(BUTTON_RIGHT, e.type == SDL_KEYDOWN);
+                    break;
+                case SDLK_y:
+                    report_button(BUTTON_A, e.type == SDL_KEYDOWN);
+                    break;
+                case SDLK_x:
+                    report_button(BUTTON_B, e.type == SDL_KEYDOWN);
+                    break;
+                case SDLK_c:
+                    report_button(BUTTON_SELECT, e.type == SDL_KEYDOWN);
+                    break;
+                case SDLK_v:
+                    report_button(BUTTON_START, e.type == SDL_KEYDOWN);
+                    break;
+                case SDLK_TAB:
+                    fast_forward = (e.type == SDL_KEYDOWN);
+                    break;
+                case SDLK_BACKSPACE:
+                    rewinding = (e.type == SDL_KEYDOWN);
+                    break;
+                case SDLK_ESCAPE:
+                    EMULATION_END = 1;
+                    break;
+                case SDLK_SPACE:
+                    frame_step ^= (e.type == SDL_KEYDOWN);
+                    printf("frame_step: %d\n", frame_step);
+                    break;
+                case SDLK_F12:
+                    if (e.type == SDL_KEYDOWN) {
+                        trace_dump_requested = 1;
+                    }
+                    break;
+                case SDLK_f:
+                    if (e.type == SDL_KEYDOWN) {
+                        printf("next frame\n");
+                        stop_frame = frame + 1;
+                    }
+                    break;
+                default: ;
+            }
+        }
+        if (e.type == SDL_WINDOWEVENT ) {
+            if (e.window.event == SDL_WINDOWEVENT_RESIZED || e.window.event == SDL_WINDOWEVENT_SHOWN) {
+                draw();
+            }
+            if (e.window.event == SDL_WINDOWEVENT_EXPOSED ) {
+                draw();
+            }
+            if (e.window.event == SDL_WINDOWEVENT_CLOSE) {
+                EMULATION_END = 1;
+            }
+        }
+    }
+}
+
 int main(int argc, char *argv[]) {
-    if(init_sdl() < 0) {
+    const char *rom = "rom/LodeRunnerUSA.nes";
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--headless") == 0) {
+            headless = true;
+        } else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            max_frames = strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--instances") == 0 && i + 1 < argc) {
+            instances = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+            json_fn = argv[++i];
+        } else if (strcmp(argv[i], "--perf") == 0 && i + 1 < argc) {
+            perf_interval = strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--perf-json") == 0 && i + 1 < argc) {
+            perf_json_fn = argv[++i];
+        } else if (strcmp(argv[i], "--frameskip") == 0 && i + 1 < argc) {
+            frameskip = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            record_fn = argv[++i];
+        } else if (strcmp(argv[i], "--play") == 0 && i + 1 < argc) {
+            play_fn = argv[++i];
+        } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            replay_fn = argv[++i];
+        } else if (strcmp(argv[i], "--rewind") == 0 && i + 1 < argc) {
+            rewind_mb = strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--rewind-interval") == 0 && i + 1 < argc) {
+            rewind_interval = strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            trace_records = strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--trace-out") == 0 && i + 1 < argc) {
+            trace_fn = argv[++i];
+        } else if (strcmp(argv[i], "--trace-stream") == 0 && i + 1 < argc) {
+            trace_stream_fn = argv[++i];
+        } else if (strcmp(argv[i], "--break") == 0 && i + 1 < argc) {
+            if (!parse_breakpoint(argv[++i])) {
+                printf("ERROR: Invalid breakpoint '%s'\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            filter_name = argv[++i];
+        } else if (strcmp(argv[i], "--filter-threads") == 0 && i + 1 < argc) {
+            filter_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--capture") == 0 && i + 1 < argc) {
+            capture_fn = argv[++i];
+        } else if (strcmp(argv[i], "--capture-audio") == 0 && i + 1 < argc) {
+            capture_audio_fn = argv[++i];
+        } else if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0) {
+            usage(argv[0]);
+            return 0;
+        } else if (argv[i][0] == '-') {
+            printf("ERROR: Unknown option '%s'\n", argv[i]);
+            usage(argv[0]);
+            return 1;
+        } else {
+            rom = argv[i];
+        }
+    }
+    if (headless && max_frames == 0) {
+        max_frames = 600;
+    }
+    if (instances < 1) {
+        instances = 1;
+    }
+    if (instances > 1 && (breakpoint_count || capture_fn || capture_audio_fn)) {
+        printf("ERROR: --break and --capture run a single console, not --instances\n");
         return 1;
     }
-    draw();
-    atexit(onExit);
+#ifndef DNES_PERF
+    if (perf_interval || perf_json_fn) {
+        printf("ERROR: Built without performance counters, use make PERF=1\n");
+        return 1;
+    }
+#endif
+    if (frameskip < 0) {
+        frameskip = (headless || replay_fn) ? 0 : 4;
+    }
+    if (capture_fn && (headless || replay_fn)) {
+        // a skipped frame would repeat the previous picture in the video
+        frameskip = 0;
+    }
+
     // cartridge_loadROM("rom/Tetris.nes");
     // cartridge_loadROM("rom/nestest.nes");
     // cartridge_loadROM("rom/Ice Climber (USA, Europe).nes");
     // cartridge_loadROM("rom/Pac-Man (USA).nes");
     // cartridge_loadROM("rom/Balloon Fight (USA).nes");
     // cartridge_loadROM("rom/DonkeyKong.nes");
-    cartridge_loadROM("rom/LodeRunnerUSA.nes");
     // cartridge_loadROM("rom/zelda.nes");
+    nes = nes_create(rom);
+    if (trace_records || trace_stream_fn) {
+        // streaming only buffers, 64k records per write by default
+        trace = trace_create(trace_records ? trace_records : 65536, trace_stream_fn);
+        if (trace == NULL) {
+            printf("ERROR: Cannot create the instruction trace\n");
+            return 1;
+        }
+        nes->trace = trace;
+        signal(SIGUSR1, request_trace_dump);
+    }
+    for (int i = 0; i < breakpoint_count; i++) {
+        debug_set(nes, breakpoints[i].types, breakpoints[i].addr, true);
+    }
 
-    d6502_t cpu;
-    d6502_init(&cpu);
-    cpu.read = readbus;
-    cpu.write = writebus;
-    
-    d6502_reset(&cpu);
-    
-    int instruction_counter = 1;
-    SDL_Event e;
-    int nmi_count = 0;
-    while( EMULATION_END == 0) {
+    if (replay_fn || headless) {
+        if (!start_capture()) {
+            return 1;
+        }
+        int ret = replay_fn ? run_replay(rom) : run_headless(rom);
+        capture_close(capture);
+        trace_exit();
+        nes_destroy(nes);
+        return ret;
+    }
 
-        while (SDL_PollEvent(&e)) {
-            if (e.type == SDL_QUIT) {
-                EMULATION_END = 1;
-            }
-            if (e.type == SDL_KEYDOWN || e.type == SDL_KEYUP) {
-                switch (e.key.keysym.sym) {
-                    case SDLK_UP:
-                        apu_report_buttonpress(BUTTON_UP, e.type == SDL_KEYDOWN);
-                        break;
-                    case SDLK_DOWN:
-                        apu_report_buttonpress(BUTTON_DOWN, e.type == SDL_KEYDOWN);
-                        break;
-                    case SDLK_LEFT:
-                        apu_report_buttonpress(BUTTON_LEFT, e.type == SDL_KEYDOWN);
-                        break;
-                    case SDLK_RIGHT:
-                        apu_report_buttonpress(BUTTON_RIGHT, e.type == SDL_KEYDOWN);
-                        break;
-                    case SDLK_y:
-                        apu_report_buttonpress(BUTTON_A, e.type == SDL_KEYDOWN);
-                        break;
-                    case SDLK_x:
-                        apu_report_buttonpress(BUTTON_B, e.type == SDL_KEYDOWN);
-                        break;
-                    case SDLK_c:
-                        apu_report_buttonpress(BUTTON_SELECT, e.type == SDL_KEYDOWN);
-                        break;
-                    case SDLK_v:
-                        apu_report_buttonpress(BUTTON_START, e.type == SDL_KEYDOWN);
-                        break;
-                    case SDLK_ESCAPE:
-                        EMULATION_END = 1;
-                        break;
-                    case SDLK_SPACE:
-                        frame_step ^= (e.type == SDL_KEYDOWN);
-                        printf("frame_step: %d\n", frame_step);
-                        break;
-                    case SDLK_f:
-                        if (e.type == SDL_KEYDOWN) {
-                            printf("next frame\n");
-                            stop_frame = frame + 1;
-                        }
-                        break;
-                    default: ;
-                }
-            }
-            if (e.type == SDL_WINDOWEVENT ) {
-                if (e.window.event == SDL_WINDOWEVENT_RESIZED || e.window.event == SDL_WINDOWEVENT_SHOWN) {
-                    draw();
-                }
-                if (e.window.event == SDL_WINDOWEVENT_EXPOSED ) {
-                    draw();
-                }
-                if (e.window.event == SDL_WINDOWEVENT_CLOSE) {
-                    EMULATION_END = 1;
-                }
-            }
-        } // while (SDL_PollEvent(&e))
-
-        if (stop_frame != frame || frame_step == 0 ) {
-
-            int clock = 0;
-            while(1) {
-                // ppu runs 3x faster than the cpu
-                ppu_tick();
-                if (dma.count < 0) {
-                    if((clock%3) == 0) {
-                        // execute instruction
-                        if( d6502_tick(&cpu) == 0 ) {
-                            break;
-                        }
-                    }
-                } else {
-                    dma_handler();
-                }
-                clock++;
-            }
-            instruction_counter++; // instruction counter
-            if (ppu_interrupt()) {
-                if(nmi_count == 0) {
-                    d6502_nmi(&cpu);
-                }
-                nmi_count++;
-            } else {
-                nmi_count = 0;
-            }
+    if (filter_name && strcmp(filter_name, "none") != 0) {
+        filter = filter_create(filter_name, filter_threads);
+        if (filter == NULL) {
+            printf("ERROR: Unknown filter '%s'\n", filter_name);
+            return 1;
         }
+        nes->ppu.raw = &raw_frame;
+        // the filter resolves the colors, only a video capture wants rgba
+        nes->ppu.raw_only = capture_fn == NULL;
+    }
+    if(init_sdl() < 0) {
+        return 1;
+    }
+    frames = tribuf_create(filter ? sizeof(ppu_raw_frame_t) : FRAME_W * FRAME_H * sizeof(uint32_t));
+    init_audio();
+    if (!start_capture()) {
+        return 1;
+    }
+    upload_frame();
+    draw();
+    atexit(onExit);
+    if (record_fn) {
+        movie = movie_record(record_fn, nes->cartridge.crc32);
+    } else if (play_fn) {
+        movie = movie_play(play_fn, nes->cartridge.crc32);
+    }
+    if ((record_fn || play_fn) && movie == NULL) {
+        printf("ERROR: Cannot open movie '%s'\n", record_fn ? record_fn : play_fn);
+        return 1;
+    }
+    // rewinding would break the movie
+    if (rewind_mb && movie == NULL) {
+        rw = rewind_create(nes, rewind_mb << 20, rewind_interval);
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_create(&emu_thread, NULL, emulate, NULL);
 
-        if( ppu_should_draw() ) {
+    // present at display rate, vsync only ever blocks this thread
+    while (EMULATION_END == 0) {
+        handle_events();
+        if (tribuf_update(frames)) {
+            upload_frame();
             draw();
-            frame++;
+        } else {
+            SDL_Delay(1);
         }
     }
+    pthread_join(emu_thread, NULL);
+    capture_close(capture);
+    perf_exit(&nes, 1, &start);
+    trace_exit();
+    if (audio_dev) {
+        SDL_CloseAudioDevice(audio_dev);
+    }
+    ring_destroy(audio_ring);
 
+    movie_close(movie);
+    rewind_destroy(rw);
+    tribuf_destroy(frames);
+    filter_destroy(filter);
+    nes_destroy(nes);
     return 0;
 }
@@ -0,0 +1,90 @@
+#include "movie.h"
+#include "nes.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MOVIE_MAGIC "DNESMOV"
+#define MOVIE_VERSION 2
+#define MOVIE_CONTROLLERS 2
+
+struct movie_t {
+    FILE *f;
+    bool recording;
+    uint32_t frames;
+};
+
+// header: magic, version, crc32 of the rom (little endian)
+static movie_t *movie_open(const char *fn, bool recording, uint32_t crc32) {
+    FILE *f = fopen(fn, recording ? "wb" : "rb");
+    if (f == NULL) {
+        return NULL;
+    }
+    uint8_t header[sizeof(MOVIE_MAGIC) + 5];
+    memcpy(header, MOVIE_MAGIC, sizeof(MOVIE_MAGIC));
+    header[sizeof(MOVIE_MAGIC)] = MOVIE_VERSION;
+    for (int i = 0; i < 4; i++) {
+        header[sizeof(MOVIE_MAGIC) + 1 + i] = crc32 >> (8 * i);
+    }
+    if (recording) {
+        fwrite(header, sizeof(header), 1, f);
+    } else {
+        uint8_t found[sizeof(header)];
+        if (fread(found, sizeof(found), 1, f) != 1 || memcmp(found, header, sizeof(MOVIE_MAGIC) + 1) != 0) {
+            printf("ERROR: '%s' is not a dnes movie of this version\n", fn);
+            fclose(f);
+            return NULL;
+        }
+        if (memcmp(found, header, sizeof(header)) != 0) {
+            // another rom or revision would desync
+            uint32_t rec = 0;
+            for (int i = 0; i < 4; i++) {
+                rec |= (uint32_t)found[sizeof(MOVIE_MAGIC) + 1 + i] << (8 * i);
+            }
+            printf("ERROR: '%s' was recorded with rom crc32 %08x, this one is %08x\n", fn, rec, crc32);
+            fclose(f);
+            return NULL;
+        }
+    }
+    movie_t *movie = (movie_t*)calloc(1, sizeof(movie_t));
+    movie->f = f;
+    movie->recording = recording;
+    return movie;
+}
+
+movie_t *movie_record(const char *fn, uint32_t crc32) {
+    return movie_open(fn, true, crc32);
+}
+
+movie_t *movie_play(const char *fn, uint32_t crc32) {
+    return movie_open(fn, false, crc32);
+}
+
+void movie_close(movie_t *movie) {
+    if (movie == NULL) {
+        return;
+    }
+    fclose(movie->f);
+    free(movie);
+}
+
+bool movie_frame(movie_t *movie, nes_t *nes) {
+    uint8_t joy[MOVIE_CONTROLLERS];
+    if (movie->recording) {
+        joy[0] = nes->apu.joy1;
+        joy[1] = nes->apu.joy2;
+        fwrite(joy, sizeof(joy), 1, movie->f);
+    } else {
+        if (fread(joy, sizeof(joy), 1, movie->f) != 1) {
+            return false;
+        }
+        nes->apu.joy1 = joy[0];
+        nes->apu.joy2 = joy[1];
+    }
+    movie->frames++;
+    return true;
+}
+
+uint32_t movie_frames(const movie_t *movie) {
+    return movie->frames;
+}
@@ -0,0 +1,29 @@
+#ifndef _MOVIE_H
+#define _MOVIE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct nes_t nes_t;
+
+// Input movies: after a short header one byte per controller per frame,
+// the button state any $4016 strobe during that frame latches. Movies are
+// streamed, only a small stdio buffer is held in memory. Played back from
+// power on they reproduce a run exactly.
+
+typedef struct movie_t movie_t;
+
+// crc32 is the cartridge's (cartridge.crc32), playback refuses movies of
+// another rom. Return NULL if the file cannot be opened or is no movie of
+// this rom.
+movie_t *movie_record(const char *fn, uint32_t crc32);
+movie_t *movie_play(const char *fn, uint32_t crc32);
+void movie_close(movie_t *movie);
+
+// call before each emulated frame: records the current controller state or
+// loads the next recorded one. Returns false when playback hit the end.
+bool movie_frame(movie_t *movie, nes_t *nes);
+
+uint32_t movie_frames(const movie_t *movie);
+
+#endif
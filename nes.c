@@ -0,0 +1,461 @@
+#include "nes.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// d6502 bus callbacks do not carry a context pointer, so the console being
+// stepped on this thread is remembered here.
+static _Thread_local nes_t *current = NULL;
+
+static uint8_t cpu_read(uint16_t addr) {
+    return nes_readbus(current, addr);
+}
+
+static void cpu_write(uint16_t addr, uint8_t dat) {
+    nes_writebus(current, addr, dat);
+}
+
+nes_t *nes_create(const char *romfn) {
+    nes_t *nes = (nes_t*)calloc(1, sizeof(nes_t));
+    if (nes == NULL) {
+        printf("ERROR: Out of memory.\n");
+        exit(1);
+    }
+    nes->dma.page = 2;
+    nes->dma.count = -1;
+    // internal ram, mirrored 4 times
+    for (int mirror = 0; mirror < 4; mirror++) {
+        nes_map_cpu(nes, mirror * 8, 8, nes->ram_internal, nes->ram_internal);
+    }
+    cartridge_loadROM(nes, romfn);
+    d6502_init(&nes->cpu);
+    nes->cpu.read = cpu_read;
+    nes->cpu.write = cpu_write;
+    ppu_init(nes);
+    apu_init(nes);
+    nes_reset(nes);
+    return nes;
+}
+
+void nes_destroy(nes_t *nes) {
+    if (nes) {
+        cartridge_cleanup(nes);
+        apu_cleanup(nes);
+        free(nes->debug);
+        free(nes);
+    }
+}
+
+void nes_reset(nes_t *nes) {
+    current = nes;
+    d6502_reset(&nes->cpu);
+}
+
+void nes_map_cpu(nes_t *nes, uint8_t page, int count, const uint8_t *read, uint8_t *write) {
+    const debug_t *dbg = nes->debug;
+    for (int i = page; i < page + count; i++) {
+        int w = debug_fold(i << 8) >> 8;
+        nes->map_read[i] = read ? read + (i - page) * 256 : NULL;
+        nes->map_write[i] = write ? write + (i - page) * 256 : NULL;
+        nes->read_page[i] = (dbg && dbg->read_watches[w]) ? NULL : nes->map_read[i];
+        nes->write_page[i] = (dbg && dbg->write_watches[w]) ? NULL : nes->map_write[i];
+    }
+}
+
+// the frame about to run is not rendered
+static bool skip_frame(const nes_t *nes) {
+    return nes->frames % (nes->frameskip + 1) != 0;
+}
+
+void nes_set_frameskip(nes_t *nes, uint32_t frameskip) {
+    nes->frameskip = frameskip;
+    nes->ppu.skip = skip_frame(nes);
+}
+
+void nes_set_irq(nes_t *nes, irq_source_t source, bool level) {
+    if (level) {
+        nes->irq_line |= source;
+        sched_add(&nes->sched, EVT_IRQ, nes->clock);
+    } else {
+        nes->irq_line &= ~source;
+    }
+}
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t size;
+    uint32_t prg_size;
+    uint32_t chr_size;
+    uint32_t crc32;
+    uint8_t mapper;
+} state_header_t;
+
+// everything that makes up the machine state, copied as is
+#define STATE_FIELD(f) { offsetof(nes_t, f), sizeof(((nes_t*)0)->f) }
+static const struct {
+    size_t offset;
+    size_t size;
+} state_fields[] = {
+    STATE_FIELD(cpu),
+    STATE_FIELD(ram_internal),
+    STATE_FIELD(dma),
+    STATE_FIELD(irq_line),
+    STATE_FIELD(ppu.tick),
+    STATE_FIELD(ppu.scanline),
+    STATE_FIELD(ppu.sprite_line),
+    STATE_FIELD(ppu.line_has_sprites),
+    STATE_FIELD(ppu.hit_xpos),
+    STATE_FIELD(ppu.interrupt),
+    STATE_FIELD(ppu.sprite0hit),
+    STATE_FIELD(ppu.ctrl),
+    STATE_FIELD(ppu.mask),
+    STATE_FIELD(ppu.status),
+    STATE_FIELD(ppu.v),
+    STATE_FIELD(ppu.t),
+    STATE_FIELD(ppu.fine_x),
+    STATE_FIELD(ppu.w),
+    STATE_FIELD(ppu.data),
+    STATE_FIELD(ppu.oam_addr),
+    STATE_FIELD(ppu.ciram),
+    STATE_FIELD(ppu.palette_ram),
+    STATE_FIELD(ppu.oam),
+    STATE_FIELD(apu),
+    STATE_FIELD(cartridge.prg_ram),
+    STATE_FIELD(cartridge.mirroring),
+    STATE_FIELD(cartridge.regs),
+    STATE_FIELD(clock),
+    STATE_FIELD(sched),
+    STATE_FIELD(instructions),
+    STATE_FIELD(frames),
+};
+#define STATE_FIELDS (sizeof(state_fields) / sizeof(state_fields[0]))
+
+static void state_header(const nes_t *nes, state_header_t *hdr) {
+    memset(hdr, 0, sizeof(*hdr));
+    memcpy(hdr->magic, "DNES", 4);
+    hdr->version = NES_STATE_VERSION;
+    hdr->size = nes_state_size(nes);
+    hdr->prg_size = nes->cartridge.prg_size;
+    hdr->chr_size = nes->cartridge.chr_size;
+    hdr->crc32 = nes->cartridge.crc32;
+    hdr->mapper = nes->cartridge.mapper;
+}
+
+size_t nes_state_size(const nes_t *nes) {
+    size_t size = sizeof(state_header_t);
+    for (size_t i = 0; i < STATE_FIELDS; i++) {
+        size += state_fields[i].size;
+    }
+    if (nes->cartridge.chr_ram) {
+        size += nes->cartridge.chr_size;
+    }
+    return size;
+}
+
+size_t nes_save_state(const nes_t *nes, void *buf, size_t size) {
+    state_header_t hdr;
+    state_header(nes, &hdr);
+    if (size < hdr.size) {
+        return 0;
+    }
+    uint8_t *p = (uint8_t*)buf;
+    memcpy(p, &hdr, sizeof(hdr));
+    p += sizeof(hdr);
+    for (size_t i = 0; i < STATE_FIELDS; i++) {
+        memcpy(p, (const uint8_t*)nes + state_fields[i].offset, state_fields[i].size);
+        p += state_fields[i].size;
+    }
+    if (nes->cartridge.chr_ram) {
+        memcpy(p, nes->cartridge.rom_chr8k, nes->cartridge.chr_size);
+    }
+    return hdr.size;
+}
+
+bool nes_load_state(nes_t *nes, const void *buf, size_t size) {
+    state_header_t hdr;
+    state_header(nes, &hdr);
+    if (size < sizeof(hdr) || memcmp(buf, &hdr, sizeof(hdr)) != 0) {
+        return false;
+    }
+    const uint8_t *p = (const uint8_t*)buf + sizeof(hdr);
+    // the bus callbacks are not part of the state
+    d6502_t cpu = nes->cpu;
+    for (size_t i = 0; i < STATE_FIELDS; i++) {
+        memcpy((uint8_t*)nes + state_fields[i].offset, p, state_fields[i].size);
+        p += state_fields[i].size;
+    }
+    nes->cpu.read = cpu.read;
+    nes->cpu.write = cpu.write;
+    if (nes->cartridge.chr_ram) {
+        cartridge_load_chr_ram(nes, p);
+    }
+    // derived state: nametable and bank pointers, cpu page table, resolved
+    // palette
+    cartridge_set_mirroring(nes, nes->cartridge.mirroring);
+    nes->cartridge.mapper_update(nes);
+    ppu_restore(nes);
+    apu_restore(nes);
+    return true;
+}
+
+static void mmio_write(nes_t *nes, uint16_t addr, uint8_t dat) {
+    switch(addr) {
+        case 0x0000 ... 0x1fff: // internal ram
+            nes->ram_internal[addr & 0x7ff] = dat;
+            break;
+        case 0x2000 ... 0x3fff: // PPU
+            ppu_write(nes, addr & 0x7, dat);
+            break;
+        case 0x4014:
+            nes->dma.count = 0;
+            nes->dma.page = dat;
+            sched_add(&nes->sched, EVT_OAM_DMA, nes->clock);
+            break;
+        case 0x4000 ... 0x4013: // APU + IO
+        case 0x4015 ... 0x401f: // APU + IO
+            apu_write(nes, addr & 0x1f, dat );
+            break;
+        case 0x6000 ... 0xffff: // cartridge
+            cartridge_cpu_write(nes, addr, dat);
+            break;
+        default:;
+    }
+}
+
+static uint8_t mmio_read(nes_t *nes, uint16_t addr) {
+    switch(addr) {
+        case 0x0000 ... 0x1fff: // internal ram
+            return nes->ram_internal[addr & 0x7ff];
+        case 0x2000 ... 0x3fff: // PPU
+            return ppu_read(nes, addr & 0x7);
+        case 0x4000 ... 0x401f: // APU + IO
+            return apu_read(nes, addr & 0x1f);
+        case 0x6000 ... 0xffff: // cartridge
+            return cartridge_cpu_read(nes, addr);
+        default: ;
+    }
+    return 0;
+}
+
+// Pages without a pointer in read_page/write_page: memory mapped io, or
+// memory hidden by a watchpoint.
+static void unmapped_write(nes_t *nes, uint16_t addr, uint8_t dat) {
+    uint8_t *mem = nes->map_write[addr >> 8];
+    if (nes->debug) {
+        uint8_t old = mem ? mem[addr & 0xff] : 0;
+        debug_write(nes, addr, old, dat, mem != NULL);
+    }
+    if (mem) {
+        mem[addr & 0xff] = dat;
+    } else {
+        mmio_write(nes, addr, dat);
+    }
+}
+
+static uint8_t unmapped_read(nes_t *nes, uint16_t addr) {
+    const uint8_t *mem = nes->map_read[addr >> 8];
+    uint8_t dat = mem ? mem[addr & 0xff] : mmio_read(nes, addr);
+    if (nes->debug) {
+        debug_read(nes, addr, dat);
+    }
+    return dat;
+}
+
+void nes_writebus(nes_t *nes, uint16_t addr, uint8_t dat) {
+    PERF_INC(nes, writes[perf_region(addr)]);
+    uint8_t *page = nes->write_page[addr >> 8];
+    if (page) {
+        page[addr & 0xff] = dat;
+    } else {
+        unmapped_write(nes, addr, dat);
+    }
+}
+
+uint8_t nes_readbus(nes_t *nes, uint16_t addr) {
+    PERF_INC(nes, reads[perf_region(addr)]);
+    const uint8_t *page = nes->read_page[addr >> 8];
+    if (page) {
+        return page[addr & 0xff];
+    }
+    return unmapped_read(nes, addr);
+}
+
+// Copies the page to oam. The cpu is halted for 513 cycles, plus one
+// alignment cycle if the dma starts on an odd cycle.
+static void dma_run(nes_t *nes) {
+    const uint8_t *src = nes->read_page[nes->dma.page];
+    const uint64_t start = nes->clock;
+    if ((start / CPU_CLOCK_DIV) & 1) {
+        nes->clock += CPU_CLOCK_DIV;
+    }
+    nes->clock += CPU_CLOCK_DIV;
+    if (src) {
+        // ram or rom: one block copy
+        ppu_oam_dma(nes, src);
+        nes->dma.count = 256;
+        nes->clock += 2 * 256 * CPU_CLOCK_DIV;
+    } else {
+        // memory mapped io, reads may have side effects, or watched memory
+        while (nes->dma.count < 256) {
+            uint8_t dat = unmapped_read(nes, nes->dma.page * 256 + nes->dma.count++);
+            nes->clock += CPU_CLOCK_DIV;
+            ppu_write(nes, 4, dat);
+            nes->clock += CPU_CLOCK_DIV;
+        }
+    }
+    nes->dma.count = -1;
+    PERF_INC(nes, dma);
+    PERF_ADD(nes, cpu_cycles, (nes->clock - start) / CPU_CLOCK_DIV);
+}
+
+// Records the instruction about to run. Opcode bytes are read straight from
+// the page table so tracing has no side effects, mmio reads as 0.
+static void trace_cpu(nes_t *nes) {
+    const d6502_t *cpu = &nes->cpu;
+    trace_record_t *rec = trace_next(nes->trace);
+    rec->clock = nes->clock;
+    rec->pc = cpu->pc;
+    for (int i = 0; i < 3; i++) {
+        uint16_t addr = cpu->pc + i;
+        const uint8_t *page = nes->map_read[addr >> 8];
+        rec->bytes[i] = page ? page[addr & 0xff] : 0;
+    }
+    rec->a = cpu->a;
+    rec->x = cpu->x;
+    rec->y = cpu->y;
+    rec->sp = cpu->sp;
+    rec->p = cpu->st;
+}
+
+static inline void cpu_instruction(nes_t *nes) {
+    if (nes->debug && debug_exec(nes)) {
+        // stopped in front of an execute breakpoint
+        return;
+    }
+    if (nes->trace) {
+        trace_cpu(nes);
+    }
+    while (d6502_tick(&nes->cpu) != 0) {
+        nes->clock += CPU_CLOCK_DIV;
+        PERF_INC(nes, cpu_cycles);
+    }
+    nes->clock += CPU_CLOCK_DIV;
+    nes->instructions++;
+    PERF_INC(nes, cpu_cycles);
+    PERF_INC(nes, instructions);
+}
+
+// d6502 only knows about nmi, the irq sequence is done here
+static void cpu_irq(nes_t *nes) {
+    d6502_t *cpu = &nes->cpu;
+    nes_writebus(nes, 0x100 + cpu->sp--, cpu->pc >> 8);
+    nes_writebus(nes, 0x100 + cpu->sp--, cpu->pc & 0xff);
+    nes_writebus(nes, 0x100 + cpu->sp--, (cpu->st & ~0x10) | 0x20);
+    cpu->st |= 0x04;
+    cpu->pc = nes_readbus(nes, 0xfffe) | (nes_readbus(nes, 0xffff) << 8);
+    nes->clock += 7 * CPU_CLOCK_DIV;
+}
+
+static void run_events(nes_t *nes) {
+    uint64_t time;
+    int type;
+    while ((type = sched_pop(&nes->sched, nes->clock, &time)) >= 0) {
+        switch (type) {
+            case EVT_FRAME_END:
+                ppu_frame_end(nes, time);
+                nes->frames++;
+                nes->frame_done = true;
+                nes->ppu.skip = skip_frame(nes);
+                break;
+            case EVT_VBLANK:
+                if (ppu_vblank(nes, time)) {
+                    d6502_nmi(&nes->cpu);
+                }
+                break;
+            case EVT_NMI:
+                d6502_nmi(&nes->cpu);
+                break;
+            case EVT_OAM_DMA:
+                dma_run(nes);
+                break;
+            case EVT_MAPPER_IRQ:
+                PERF_INC(nes, mapper_irq);
+                nes->cartridge.mapper_event(nes, time);
+                break;
+            case EVT_APU_FRAME:
+                apu_frame_event(nes, time);
+                break;
+            case EVT_APU_DMC:
+                apu_dmc_event(nes, time);
+                break;
+            case EVT_BREAK:
+                nes->stopped = true;
+                break;
+            case EVT_IRQ:
+                if (nes->irq_line == 0) {
+                    break;
+                }
+                if (nes->cpu.st & 0x04) {
+                    // masked, poll again after the next instruction
+                    sched_add(&nes->sched, EVT_IRQ, nes->clock + CPU_CLOCK_DIV);
+                } else {
+                    cpu_irq(nes);
+                }
+                break;
+            default: ;
+        }
+    }
+}
+
+static void clear_stop(nes_t *nes) {
+    nes->stopped = false;
+    if (nes->debug) {
+        nes->debug->hit = false;
+    }
+}
+
+bool nes_step(nes_t *nes) {
+    current = nes;
+    nes->frame_done = false;
+    clear_stop(nes);
+    cpu_instruction(nes);
+    if (nes->clock >= sched_next(&nes->sched)) {
+        run_events(nes);
+    }
+    return nes->frame_done;
+}
+
+void nes_run_frame(nes_t *nes) {
+    current = nes;
+    PERF_START(start);
+    nes->frame_done = false;
+    clear_stop(nes);
+    while (!nes->frame_done && !nes->stopped) {
+        // instructions may schedule events due right away ($4014, irqs,
+        // breakpoints), so the next event time is not cached
+        while (nes->clock < sched_next(&nes->sched)) {
+            cpu_instruction(nes);
+        }
+        run_events(nes);
+    }
+    PERF_STOP(nes, frame_ns, start);
+    PERF_INC(nes, frames);
+}
+
+typedef struct {
+    nes_t **nes;
+    uint32_t frames;
+} run_parallel_t;
+
+static void run_parallel_task(void *ctx, int index) {
+    run_parallel_t *job = (run_parallel_t*)ctx;
+    for (uint32_t i = 0; i < job->frames; i++) {
+        nes_run_frame(job->nes[index]);
+    }
+}
+
+void nes_run_parallel(pool_t *pool, nes_t **nes, int count, uint32_t frames) {
+    run_parallel_t job = { .nes = nes, .frames = frames };
+    pool_run(pool, count, run_parallel_task, &job);
+}
@@ -0,0 +1,123 @@
+#ifndef _NES_H
+#define _NES_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "d6502.h"
+#include "ppu.h"
+#include "apu.h"
+#include "blip.h"
+#include "cartridge.h"
+#include "pool.h"
+#include "sched.h"
+#include "perf.h"
+#include "trace.h"
+#include "debug.h"
+
+// clocks in ppu dots
+#define CPU_CLOCK_DIV 3
+
+typedef enum {
+    EVT_FRAME_END,  // ppu finished a frame
+    EVT_VBLANK,     // vblank flag set, nmi if enabled
+    EVT_NMI,        // nmi enabled during vblank
+    EVT_OAM_DMA,    // $4014 written, runs at the next instruction boundary
+    EVT_MAPPER_IRQ, // mapper irq counter needs the ppu synced
+    EVT_IRQ,        // irq line asserted, taken at the next instruction boundary
+    EVT_APU_FRAME,  // apu frame sequencer step
+    EVT_APU_DMC,    // dmc may fetch its last sample byte (irq)
+    EVT_BREAK,      // breakpoint hit, stop at the instruction boundary
+} event_type_t;
+
+// sources driving the shared cpu irq line
+typedef enum {
+    IRQ_MAPPER = 0x01,
+    IRQ_APU_FRAME = 0x02,
+    IRQ_DMC = 0x04,
+} irq_source_t;
+
+typedef struct {
+    uint8_t page;
+    int count; // if < 0 then no dma active
+} dma_t;
+
+// One complete console. All machine state lives in here, so any number of
+// consoles can run side by side in one process.
+typedef struct nes_t {
+    d6502_t cpu;
+    // cpu address space in 256 byte pages. A page with a pointer is plain
+    // memory, NULL pages are memory mapped io and go through the handlers.
+    const uint8_t *read_page[256];
+    uint8_t *write_page[256];
+    // what ram and the cartridge mapped, read_page/write_page leave out
+    // pages with watchpoints
+    const uint8_t *map_read[256];
+    uint8_t *map_write[256];
+    uint8_t ram_internal[0x800];
+    dma_t dma;
+    uint8_t irq_line; // irq_source_t bits currently asserted
+    ppu_t ppu;
+    apu_t apu;
+    cartridge_t cartridge;
+    blip_t *audio; // sound output, NULL if the apu produces none
+    trace_t *trace; // instruction trace, NULL if off (owned by the caller)
+    debug_t *debug; // breakpoints, NULL if none are set
+
+    // master clock in ppu dots since power on. Inside an instruction this is
+    // the dot of the current cpu cycle, the ppu catches up to it lazily.
+    uint64_t clock;
+    sched_t sched;
+    bool frame_done;
+    bool stopped; // a breakpoint ended the last nes_run_frame/nes_step early
+    // only every (frameskip + 1)th frame is rendered to ppu.pixels
+    uint32_t frameskip;
+
+    // throughput counters
+    uint64_t instructions;
+    uint32_t frames;
+#ifdef DNES_PERF
+    perf_t perf;
+#endif
+} nes_t;
+
+nes_t *nes_create(const char *romfn);
+void nes_destroy(nes_t *nes);
+void nes_reset(nes_t *nes);
+
+// maps cpu pages [page, page + count) to mem (NULL unmaps them)
+void nes_map_cpu(nes_t *nes, uint8_t page, int count, const uint8_t *read, uint8_t *write);
+
+// Save states are flat binary blobs: a header followed by the raw machine
+// state. Bump NES_STATE_VERSION whenever a saved structure changes.
+#define NES_STATE_VERSION 7
+
+// size of a save state of this console in bytes
+size_t nes_state_size(const nes_t *nes);
+// writes a save state to buf, returns the number of bytes written or 0 if
+// size is too small. Does not allocate.
+size_t nes_save_state(const nes_t *nes, void *buf, size_t size);
+// restores a save state, returns false if it is not a state of this
+// version and cartridge
+bool nes_load_state(nes_t *nes, const void *buf, size_t size);
+
+// changes frameskip, already for the frame that runs next
+void nes_set_frameskip(nes_t *nes, uint32_t frameskip);
+
+// asserts or releases the irq line for source
+void nes_set_irq(nes_t *nes, irq_source_t source, bool level);
+
+void nes_writebus(nes_t *nes, uint16_t addr, uint8_t dat);
+uint8_t nes_readbus(nes_t *nes, uint16_t addr);
+
+// executes one cpu instruction and the events due after it,
+// returns true when a frame has been finished
+bool nes_step(nes_t *nes);
+// runs the cpu from event to event until the ppu finished a frame or a
+// breakpoint was hit (nes->stopped, see debug_hit)
+void nes_run_frame(nes_t *nes);
+
+// runs frames on every console in nes[], spread across the pool workers
+void nes_run_parallel(pool_t *pool, nes_t **nes, int count, uint32_t frames);
+
+#endif
@@ -25,7 +25,7 @@
 // };
 
 
-const uint32_t nescolors[64] = {
+static const uint32_t nescolors[64] = {
     //AARRGGBB --> SDL_PIXELFORMAT_BGRA32
     0xff808080,
     0xff003DA6,
@@ -0,0 +1,65 @@
+#include "perf.h"
+#include <time.h>
+
+static const char *region_names[PERF_REGIONS] = { "ram", "ppu", "io", "cart" };
+
+uint64_t perf_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void perf_add(perf_t *dst, const perf_t *src) {
+    const uint64_t *s = (const uint64_t*)src;
+    uint64_t *d = (uint64_t*)dst;
+    for (size_t i = 0; i < sizeof(perf_t) / sizeof(uint64_t); i++) {
+        d[i] += s[i];
+    }
+}
+
+void perf_print_line(FILE *f, const perf_t *cur, const perf_t *prev, double secs) {
+    perf_t d;
+    const uint64_t *c = (const uint64_t*)cur;
+    const uint64_t *p = (const uint64_t*)prev;
+    uint64_t *o = (uint64_t*)&d;
+    for (size_t i = 0; i < sizeof(perf_t) / sizeof(uint64_t); i++) {
+        o[i] = c[i] - p[i];
+    }
+    if (secs <= 0) {
+        secs = 1e-9;
+    }
+    double frames = d.frames ? d.frames : 1;
+    fprintf(f, "perf: %.1f fps, %.0f instr/s, %.0f cycles/s, %.0f lines/s",
+        d.frames / secs, d.instructions / secs, d.cpu_cycles / secs, d.ppu_lines / secs);
+    for (int r = 0; r < PERF_REGIONS; r++) {
+        fprintf(f, ", %s r/w %.0f/%.0f", region_names[r], d.reads[r] / frames, d.writes[r] / frames);
+    }
+    fprintf(f, " per frame, mapper cpu/ppu/irq %llu/%llu/%llu, dma %llu",
+        (unsigned long long)d.mapper_cpu, (unsigned long long)d.mapper_ppu,
+        (unsigned long long)d.mapper_irq, (unsigned long long)d.dma);
+    fprintf(f, ", us/frame cpu %.1f ppu %.1f present %.1f\n",
+        (d.frame_ns - d.ppu_ns) / frames / 1e3, d.ppu_ns / frames / 1e3, d.present_ns / frames / 1e3);
+}
+
+void perf_write_json(FILE *f, const perf_t *perf, double secs) {
+    fprintf(f, "{\n  \"seconds\": %.6f,\n", secs);
+    fprintf(f, "  \"frames\": %llu,\n", (unsigned long long)perf->frames);
+    fprintf(f, "  \"instructions\": %llu,\n", (unsigned long long)perf->instructions);
+    fprintf(f, "  \"cpu_cycles\": %llu,\n", (unsigned long long)perf->cpu_cycles);
+    fprintf(f, "  \"ppu_lines\": %llu,\n", (unsigned long long)perf->ppu_lines);
+    for (int w = 0; w < 2; w++) {
+        const uint64_t *count = w ? perf->writes : perf->reads;
+        fprintf(f, "  \"%s\": {", w ? "writes" : "reads");
+        for (int r = 0; r < PERF_REGIONS; r++) {
+            fprintf(f, "%s\"%s\": %llu", r ? ", " : " ", region_names[r], (unsigned long long)count[r]);
+        }
+        fprintf(f, " },\n");
+    }
+    fprintf(f, "  \"mapper\": { \"cpu\": %llu, \"ppu\": %llu, \"irq\": %llu },\n",
+        (unsigned long long)perf->mapper_cpu, (unsigned long long)perf->mapper_ppu,
+        (unsigned long long)perf->mapper_irq);
+    fprintf(f, "  \"dma\": %llu,\n", (unsigned long long)perf->dma);
+    fprintf(f, "  \"ns\": { \"cpu\": %llu, \"ppu\": %llu, \"present\": %llu }\n}\n",
+        (unsigned long long)(perf->frame_ns - perf->ppu_ns), (unsigned long long)perf->ppu_ns,
+        (unsigned long long)perf->present_ns);
+}
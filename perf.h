@@ -0,0 +1,57 @@
+#ifndef _PERF_H
+#define _PERF_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Performance counters, compiled in with -DDNES_PERF (make PERF=1). Without
+// it the PERF_* macros expand to nothing and nes_t carries no counters.
+
+typedef enum {
+    PERF_RAM,     // $0000-$1fff
+    PERF_PPU,     // $2000-$3fff
+    PERF_IO,      // $4000-$401f
+    PERF_CART,    // $4020-$ffff
+    PERF_REGIONS,
+} perf_region_t;
+
+typedef struct {
+    uint64_t instructions;
+    uint64_t cpu_cycles;
+    uint64_t ppu_lines;
+    uint64_t reads[PERF_REGIONS];
+    uint64_t writes[PERF_REGIONS];
+    uint64_t mapper_cpu;  // mapper cpu read/write callbacks
+    uint64_t mapper_ppu;  // mapper ppu read/write callbacks
+    uint64_t mapper_irq;  // scanline and event callbacks
+    uint64_t dma;         // oam dma transfers
+    uint64_t frames;
+    // wall time in ns, cpu is frame time minus ppu
+    uint64_t frame_ns;
+    uint64_t ppu_ns;
+    uint64_t present_ns;  // handing the frame and samples to the front end
+} perf_t;
+
+static inline perf_region_t perf_region(uint16_t addr) {
+    return addr < 0x2000 ? PERF_RAM : addr < 0x4000 ? PERF_PPU : addr < 0x4020 ? PERF_IO : PERF_CART;
+}
+
+uint64_t perf_now(void);
+void perf_add(perf_t *dst, const perf_t *src);
+// one line with the rates between prev and cur over secs seconds
+void perf_print_line(FILE *f, const perf_t *cur, const perf_t *prev, double secs);
+void perf_write_json(FILE *f, const perf_t *perf, double secs);
+
+#ifdef DNES_PERF
+#define PERF_INC(nes, field) ((nes)->perf.field++)
+#define PERF_ADD(nes, field, n) ((nes)->perf.field += (n))
+#define PERF_START(var) uint64_t var = perf_now()
+#define PERF_STOP(nes, field, var) ((nes)->perf.field += perf_now() - (var))
+#else
+#define PERF_INC(nes, field) ((void)0)
+#define PERF_ADD(nes, field, n) ((void)0)
+#define PERF_START(var)
+#define PERF_STOP(nes, field, var) ((void)0)
+#endif
+
+#endif
@@ -0,0 +1,130 @@
+#include "pool.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+struct pool_t {
+    pthread_t *threads;
+    int nthreads;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+    uint64_t generation; // bumped for every pool_run()
+    int busy; // workers still inside the current job
+    bool quit;
+
+    // current job
+    pool_task_t task;
+    void *ctx;
+    int count;
+    atomic_int next;
+};
+
+static void pool_work(pool_t *pool) {
+    int i;
+    while ((i = atomic_fetch_add_explicit(&pool->next, 1, memory_order_relaxed)) < pool->count) {
+        pool->task(pool->ctx, i);
+    }
+}
+
+static void *pool_worker(void *arg) {
+    pool_t *pool = (pool_t*)arg;
+    uint64_t seen = 0;
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while (!pool->quit && pool->generation == seen) {
+            pthread_cond_wait(&pool->work_cond, &pool->lock);
+        }
+        if (pool->quit) {
+            break;
+        }
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        pool_work(pool);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->busy == 0) {
+            pthread_cond_signal(&pool->done_cond);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+pool_t *pool_create(int nthreads) {
+    if (nthreads <= 0) {
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (nthreads <= 0) {
+        nthreads = 1;
+    }
+    pool_t *pool = (pool_t*)calloc(1, sizeof(pool_t));
+    if (pool == NULL) {
+        printf("ERROR: Out of memory.\n");
+        exit(1);
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+    // the thread calling pool_run() is the first worker
+    pool->nthreads = nthreads;
+    pool->threads = (pthread_t*)calloc(nthreads, sizeof(pthread_t));
+    for (int i = 1; i < nthreads; i++) {
+        if (pthread_create(&pool->threads[i], NULL, pool_worker, pool) != 0) {
+            printf("ERROR: Cannot create worker thread.\n");
+            exit(1);
+        }
+    }
+    return pool;
+}
+
+void pool_destroy(pool_t *pool) {
+    if (pool == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = true;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 1; i < pool->nthreads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pthread_cond_destroy(&pool->done_cond);
+    pthread_cond_destroy(&pool->work_cond);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->threads);
+    free(pool);
+}
+
+int pool_size(const pool_t *pool) {
+    return pool->nthreads;
+}
+
+void pool_run(pool_t *pool, int count, pool_task_t task, void *ctx) {
+    if (count <= 0) {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->task = task;
+    pool->ctx = ctx;
+    pool->count = count;
+    atomic_store(&pool->next, 0);
+    pool->busy = pool->nthreads - 1;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    pool_work(pool);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->busy > 0) {
+        pthread_cond_wait(&pool->done_cond, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
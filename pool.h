@@ -0,0 +1,19 @@
+#ifndef _POOL_H
+#define _POOL_H
+
+// Fixed set of worker threads running parallel-for style jobs.
+
+typedef struct pool_t pool_t;
+
+typedef void (*pool_task_t)(void *ctx, int index);
+
+// nthreads <= 0 uses one worker per online cpu core
+pool_t *pool_create(int nthreads);
+void pool_destroy(pool_t *pool);
+int pool_size(const pool_t *pool);
+
+// calls task(ctx, i) for every i in [0, count) and returns when all are done.
+// The calling thread takes part in the work.
+void pool_run(pool_t *pool, int count, pool_task_t task, void *ctx);
+
+#endif
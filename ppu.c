@@ -5,37 +5,53 @@
 #include <assert.h>
 #include <stdio.h>
 #include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
 #include "nescolors.h"
 #include "cartridge.h"
+#include "nes.h"
 
 #define TICKS_PER_FRAME (TOTAL_FRAME_W * TOTAL_FRAME_H)
+// frame dot which raises the vblank flag (line 241, dot 1)
+#define VBLANK_DOT ((FRAME_H + 1) * TOTAL_FRAME_W + 1)
 #define PATTERN_TABLE_0 0x0000
 #define PATTERN_TABLE_1 0x1000
 #define NAME_TABLE_0 0x2000
 
-#define BACKGROUND_COLOR (vram[0x3f00])
+#define BACKGROUND_COLOR (ppu->palette_ram[0])
 
 // ppu_ctrl register
-#define SPRITE_PATTERN_TABLE_SEL    (ppu_ctrl & 0x08)
-#define BG_PATTERN_TABLE_SEL        (ppu_ctrl & 0x10)
-#define SPRITE_SIZE_8x16            (ppu_ctrl & 0x20)
+#define SPRITE_PATTERN_TABLE_SEL    (ppu->ctrl & 0x08)
+#define BG_PATTERN_TABLE_SEL        (ppu->ctrl & 0x10)
+#define SPRITE_SIZE_8x16            (ppu->ctrl & 0x20)
 
 // ppu_mask register
-#define COLOR_ENABLED           (ppu_mask & 0x01)
-#define BG_LEFT_ENABLED         (ppu_mask & 0x02)
-#define SPRITES_LEFT_ENABLED    (ppu_mask & 0x04)
-#define SHOW_BG_ENABLED         (ppu_mask & 0x08)
-#define SHOW_SPRITES_ENABLED    (ppu_mask & 0x10)
-#define EMPHASIZE_RED_ENABLED   (ppu_mask & 0x20)
-#define EMPHASIZE_GREEN_ENABLED (ppu_mask & 0x40)
-#define EMPHASIZE_BLUE_ENABLED  (ppu_mask & 0x80)
+#define COLOR_ENABLED           (ppu->mask & 0x01)
+#define BG_LEFT_ENABLED         (ppu->mask & 0x02)
+#define SPRITES_LEFT_ENABLED    (ppu->mask & 0x04)
+#define SHOW_BG_ENABLED         (ppu->mask & 0x08)
+#define SHOW_SPRITES_ENABLED    (ppu->mask & 0x10)
+#define EMPHASIZE_RED_ENABLED   (ppu->mask & 0x20)
+#define EMPHASIZE_GREEN_ENABLED (ppu->mask & 0x40)
+#define EMPHASIZE_BLUE_ENABLED  (ppu->mask & 0x80)
 
 // ppu_status
 #define VBLANK_MASK 0x80
 #define SPRITE0HIT_MASK 0x40
+#define SPRITE_OVERFLOW_MASK 0x20
 
-#define SCROLL_X (ppu_scroll[0])
-#define SCROLL_Y (ppu_scroll[1])
+#define RENDERING_ENABLED (ppu->mask & 0x18)
+
+// parts of v and t
+#define LOOPY_COARSE_X 0x001f
+#define LOOPY_COARSE_Y 0x03e0
+#define LOOPY_NT_X     0x0400
+#define LOOPY_NT_Y     0x0800
+#define LOOPY_FINE_Y   0x7000
+#define LOOPY_HORIZONTAL (LOOPY_COARSE_X | LOOPY_NT_X)
+#define LOOPY_VERTICAL   (LOOPY_COARSE_Y | LOOPY_NT_Y | LOOPY_FINE_Y)
 
 typedef struct {
     uint8_t y;
@@ -44,124 +60,240 @@ typedef struct {
     uint8_t x;
 } sprite_t;
 
-static uint32_t tick = 0;
-/* static*/ uint32_t pixels[FRAME_W * FRAME_H];
-static bool interrupt = false;
-static bool sprite0hit = false;
-
-uint8_t ppu_ctrl = 0;
-uint8_t ppu_mask = 0;
-uint8_t ppu_status = 0;
-uint8_t ppu_scroll[2] = {0, 0};
-uint16_t ppuaddr = 0;
-uint8_t ppudata = 0;
-uint8_t oam_addr = 0;
+#define OAM_SPRITE_Y(a) (ppu->oam[a])
+#define OAM_SPRITE_INDEX(a) (ppu->oam[a+1])
+#define OAM_SPRITE_ATTR(a) (ppu->oam[a+2])
+#define OAM_SPRITE_X(a) (ppu->oam[a+3])
+
+// Sorts the sprites into per line buckets. oam_addr is used as sprite 0
+// (an offset into the raw oam), evaluation runs from there to the end.
+// Only whole sprites are taken: an unaligned oam_addr leaves a partial one
+// at the end, which would be read past oam[].
+static void build_sprite_index(ppu_t *ppu) {
+    const int height = SPRITE_SIZE_8x16 ? 16 : 8;
+    memset(ppu->line_count, 0, sizeof(ppu->line_count));
+    for (int i = ppu->oam_addr; i + 4 <= 0x100; i += 4) {
+        int top = OAM_SPRITE_Y(i);
+        int bottom = (top + height < FRAME_H) ? top + height : FRAME_H;
+        for (int y = top; y < bottom; y++) {
+            if (ppu->line_count[y] < 8) {
+                ppu->line_sprites[y][ppu->line_count[y]] = i;
+            }
+            ppu->line_count[y]++;
+        }
+    }
+    ppu->sprites_dirty = false;
+    ppu->sprites_first = ppu->oam_addr;
+    ppu->sprites_height = height;
+}
 
-uint8_t vram[0x4000];
+const uint32_t *ppu_getFrameBuffer(nes_t *nes) {
+    return &nes->ppu.pixels[0];
+}
 
-#define OAM_SPRITE_Y(a) (oam[a])
-#define OAM_SPRITE_INDEX(a) (oam[a+1])
-#define OAM_SPRITE_ATTR(a) (oam[a+2])
-#define OAM_SPRITE_X(a) (oam[a+3])
+static void update_palette(ppu_t *ppu) {
+    for (int i = 0; i < 32; i++) {
+        // entry 0 of every palette shows the backdrop color
+        ppu->palette[i] = nescolors[ppu->palette_ram[(i % 4) ? i : 0] & 0x3f];
+    }
+}
 
-uint8_t oam[0x100];
+// Converts n palette indices (0..31) to rgba pixels
+typedef void (*convert_fn)(uint32_t *dst, const uint8_t *idx, int n, const uint32_t *palette);
 
-uint8_t local_sprites[8];
+static void convert_scalar(uint32_t *dst, const uint8_t *idx, int n, const uint32_t *palette) {
+    for (int i = 0; i < n; i++) {
+        dst[i] = palette[idx[i]];
+    }
+}
 
-void oam_collectSprites(uint8_t y) {
-    int s = 0;
-    // oam_addr is used as sprite 0 (index into oam.raw!)
-    for(int i = oam_addr; i < 0x100 && s < 8; i+=4) {
-        if ((y >= OAM_SPRITE_Y(i)) && (y < OAM_SPRITE_Y(i)+8)) {
-            local_sprites[s++] = i;
+#ifdef HAVE_X86_SIMD
+// 16 pixels per step: each byte plane of the palette is looked up with pshufb
+// (low and high half of the 32 entries), then the planes are interleaved.
+__attribute__((target("ssse3")))
+static void convert_ssse3(uint32_t *dst, const uint8_t *idx, int n, const uint32_t *palette) {
+    uint8_t planes[4][32];
+    for (int i = 0; i < 32; i++) {
+        for (int b = 0; b < 4; b++) {
+            planes[b][i] = palette[i] >> (8 * b);
         }
     }
-    for (; s < 8; s++) {
-        local_sprites[s] = 0xff;
+    __m128i lo[4], hi[4];
+    for (int b = 0; b < 4; b++) {
+        lo[b] = _mm_loadu_si128((const __m128i*)&planes[b][0]);
+        hi[b] = _mm_loadu_si128((const __m128i*)&planes[b][16]);
+    }
+    const __m128i fifteen = _mm_set1_epi8(15);
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)&idx[i]);
+        __m128i upper = _mm_cmpgt_epi8(v, fifteen);
+        __m128i c[4];
+        for (int b = 0; b < 4; b++) {
+            __m128i l = _mm_shuffle_epi8(lo[b], v);
+            __m128i h = _mm_shuffle_epi8(hi[b], v);
+            c[b] = _mm_or_si128(_mm_andnot_si128(upper, l), _mm_and_si128(upper, h));
+        }
+        __m128i c01lo = _mm_unpacklo_epi8(c[0], c[1]);
+        __m128i c01hi = _mm_unpackhi_epi8(c[0], c[1]);
+        __m128i c23lo = _mm_unpacklo_epi8(c[2], c[3]);
+        __m128i c23hi = _mm_unpackhi_epi8(c[2], c[3]);
+        _mm_storeu_si128((__m128i*)&dst[i +  0], _mm_unpacklo_epi16(c01lo, c23lo));
+        _mm_storeu_si128((__m128i*)&dst[i +  4], _mm_unpackhi_epi16(c01lo, c23lo));
+        _mm_storeu_si128((__m128i*)&dst[i +  8], _mm_unpacklo_epi16(c01hi, c23hi));
+        _mm_storeu_si128((__m128i*)&dst[i + 12], _mm_unpackhi_epi16(c01hi, c23hi));
     }
+    convert_scalar(&dst[i], &idx[i], n - i, palette);
 }
 
-const uint32_t *ppu_getFrameBuffer(void) {
-    return &pixels[0];
+// 8 pixels per step with a gather from the palette
+__attribute__((target("avx2")))
+static void convert_avx2(uint32_t *dst, const uint8_t *idx, int n, const uint32_t *palette) {
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)&idx[i]));
+        __m256i px = _mm256_i32gather_epi32((const int*)palette, v, 4);
+        _mm256_storeu_si256((__m256i*)&dst[i], px);
+    }
+    convert_scalar(&dst[i], &idx[i], n - i, palette);
 }
 
-void setpixel( int x, int y, uint8_t color ) {
-    int p = y * FRAME_W + x;
-    if( p >= sizeof(pixels)) {
-        printf("x: %d, y: %d\n", x, y);
-        assert(p < sizeof(pixels));
+#endif
+
+static convert_fn convert = NULL;
+
+static void select_convert(void) {
+    convert = convert_scalar;
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        convert = convert_avx2;
+    } else if (__builtin_cpu_supports("ssse3")) {
+        convert = convert_ssse3;
     }
-    if ((color % 4) == 0) {
-        color = 0; // backdrop color
+#endif
+}
+
+void ppu_init(nes_t *nes) {
+    if (convert == NULL) {
+        select_convert();
     }
-    uint16_t addr = 0x3f00 + color;
-    pixels[p] = nescolors[vram[addr]];
+    update_palette(&nes->ppu);
+    // the vblank flag is raised while rendering dot VBLANK_DOT
+    sched_add(&nes->sched, EVT_VBLANK, VBLANK_DOT + 1);
+    sched_add(&nes->sched, EVT_FRAME_END, TICKS_PER_FRAME);
 }
 
-const uint16_t getBGTileAddr(uint8_t idx) {
-    uint16_t base = BG_PATTERN_TABLE_SEL ? PATTERN_TABLE_1 : PATTERN_TABLE_0;
-    return base + 16 * idx;
+void ppu_restore(nes_t *nes) {
+    update_palette(&nes->ppu);
+    nes->ppu.sprites_dirty = true;
 }
 
-void ppu_write(uint8_t addr, uint8_t dat) {
+void ppu_write(nes_t *nes, uint8_t addr, uint8_t dat) {
+    ppu_t *ppu = &nes->ppu;
+    ppu_sync(nes);
     switch(addr) {
         case 0: // PPUCTRL, PPU Control Register #1
-            ppu_ctrl = dat;
+            if (!(ppu->ctrl & VBLANK_MASK) && (dat & VBLANK_MASK) && ppu->interrupt) {
+                // nmi enabled while in vblank
+                sched_add(&nes->sched, EVT_NMI, nes->clock);
+            }
+            ppu->ctrl = dat;
+            ppu->t = (ppu->t & ~(LOOPY_NT_X | LOOPY_NT_Y)) | ((dat & 0x03) << 10);
+            if (nes->cartridge.mapper_event) {
+                // pattern table selection moves the a12 rise
+                sched_add(&nes->sched, EVT_MAPPER_IRQ, nes->clock);
+            }
             break;
         case 1: // PPUMASK, PPU Control Register #2
-            ppu_mask = dat;
+            ppu->mask = dat;
+            if (nes->cartridge.mapper_event) {
+                sched_add(&nes->sched, EVT_MAPPER_IRQ, nes->clock);
+            }
             break;
         case 2: // PPUSTATUS, PPU Status Register
             break;
         case 3: // OAMADDR, SPR-RAM Address Register
-            oam_addr = dat;
+            ppu->oam_addr = dat;
             break;
         case 4: // OAMDATA, SPR-RAM I/O Register
-            // printf("OAMDATA %02X %02X\n",oam_addr, dat);
-            oam[oam_addr++] = dat;
+            ppu->oam[ppu->oam_addr++] = dat;
+            ppu->sprites_dirty = true;
             break;
         case 5: // PPUSCROLL, VRAM Address Register #1 (W2)
-            ppu_scroll[0] = ppu_scroll[1];
-            ppu_scroll[1] = dat;
+            if (!ppu->w) {
+                ppu->t = (ppu->t & ~LOOPY_COARSE_X) | (dat >> 3);
+                ppu->fine_x = dat & 7;
+            } else {
+                ppu->t = (ppu->t & ~(LOOPY_COARSE_Y | LOOPY_FINE_Y)) | ((dat & 0xf8) << 2) | ((dat & 7) << 12);
+            }
+            ppu->w = !ppu->w;
             break;
         case 6: // PPUADDR, VRAM Address Register #2 (W2)
-            ppuaddr = ((ppuaddr & 0x3f) << 8) | dat;
-            // printf("PPUADDR %02X --> %04X\n", dat, ppuaddr);
+            if (!ppu->w) {
+                ppu->t = (ppu->t & 0x00ff) | ((dat & 0x3f) << 8);
+            } else {
+                // takes effect right away, mid-frame scroll changes use this
+                ppu->t = (ppu->t & 0xff00) | dat;
+                ppu->v = ppu->t;
+            }
+            ppu->w = !ppu->w;
             break;
         case 7: // PPUDATA, VRAM I/O Register
-            cartridge_ppu_write(ppuaddr, dat);
-            ppuaddr += (ppu_ctrl & 0x04) ? 32 : 1;
+            if (nes->debug) {
+                debug_ppu(nes, ppu->v, dat, true);
+            }
+            cartridge_ppu_write(nes, ppu->v & 0x3fff, dat);
+            if ((ppu->v & 0x3fff) >= 0x3f00) {
+                update_palette(ppu);
+            }
+            ppu->v = (ppu->v + ((ppu->ctrl & 0x04) ? 32 : 1)) & 0x7fff;
             break;
         default:;
     }
 }
 
-uint8_t ppu_read(uint8_t addr) {
+void ppu_oam_dma(nes_t *nes, const uint8_t *src) {
+    ppu_t *ppu = &nes->ppu;
+    ppu_sync(nes);
+    // oam_addr wraps around and ends where it started
+    int n = 0x100 - ppu->oam_addr;
+    memcpy(&ppu->oam[ppu->oam_addr], src, n);
+    memcpy(&ppu->oam[0], src + n, 0x100 - n);
+    ppu->sprites_dirty = true;
+}
+
+uint8_t ppu_read(nes_t *nes, uint8_t addr) {
+    ppu_t *ppu = &nes->ppu;
+    ppu_sync(nes);
     uint8_t val = 0;
     switch(addr) {
         case 0: // PPUCTRL, PPU Control Register #1
-            val = ppu_ctrl;
+            val = ppu->ctrl;
             break;
         case 1: // PPUMASK, PPU Control Register #2
-            val = ppu_mask;
+            val = ppu->mask;
             break;
         case 2: // PPUSTATUS, PPU Status Register
-            val = ppu_status;
-            ppu_status &= ~VBLANK_MASK;
+            val = ppu->status;
+            ppu->status &= ~VBLANK_MASK;
+            ppu->w = false;
             break;
         case 3: // OAMADDR, SPR-RAM Address Register
             break;
         case 4: // OAMDATA, SPR-RAM I/O Register
-            val = oam[oam_addr];
+            val = ppu->oam[ppu->oam_addr];
             break;
         case 5: // PPUSCROLL, VRAM Address Register #1 (W2)
             break;
         case 6: // PPUADDR, VRAM Address Register #2 (W2)
-            val = ppuaddr;
             break;
         case 7: // PPUDATA, VRAM I/O Register
-            val = cartridge_ppu_read(ppuaddr);
-            ppuaddr += (ppu_ctrl & 0x04) ? 32 : 1;
+            val = cartridge_ppu_read(nes, ppu->v & 0x3fff);
+            if (nes->debug) {
+                debug_ppu(nes, ppu->v, val, false);
+            }
+            ppu->v = (ppu->v + ((ppu->ctrl & 0x04) ? 32 : 1)) & 0x7fff;
             break;
         default:
             break;
@@ -169,104 +301,147 @@ uint8_t ppu_read(uint8_t addr) {
     return val;
 }
 
-uint16_t getNameTableAddr(void) {
-    uint16_t addr; // = NAME_TABLE_0 | ((ppu_ctrl & 0x3) << 10);
-    switch(ppu_ctrl & 0x03) {
-        case 0: addr = NAME_TABLE_0; break;
-        case 1: addr = NAME_TABLE_0 | 0x400; break;
-        case 2: addr = NAME_TABLE_0 | 0x800; break;
-        case 3: addr = NAME_TABLE_0 | 0xC00; break;
-    }
-    return addr;
+bool ppu_vblank(nes_t *nes, uint64_t time) {
+    ppu_sync(nes);
+    sched_add(&nes->sched, EVT_VBLANK, time + TICKS_PER_FRAME);
+    return (nes->ppu.ctrl & VBLANK_MASK) && nes->ppu.interrupt;
 }
 
-bool ppu_interrupt(void) {
-    return (ppu_ctrl & VBLANK_MASK) && interrupt;
+void ppu_frame_end(nes_t *nes, uint64_t time) {
+    ppu_sync(nes);
+    sched_add(&nes->sched, EVT_FRAME_END, time + TICKS_PER_FRAME);
 }
 
-bool ppu_should_draw(void) {
-    static uint32_t last = 0;
-    if (tick > last + TICKS_PER_FRAME) {
-        last = tick;
-        return true;
+#define PATTERN_TABLE_BASE() (BG_PATTERN_TABLE_SEL ? PATTERN_TABLE_1 : PATTERN_TABLE_0)
+
+#define BYTES8(b) ((b) * 0x0101010101010101ull)
+
+// Moves coarse x of v on by n tiles, into the next nametable past column 31
+static inline uint16_t advance_coarse_x(uint16_t v, int n) {
+    int cx = (v & LOOPY_COARSE_X) + n;
+    if (cx >= 32) {
+        v ^= LOOPY_NT_X;
     }
-    return false;
+    return (v & ~LOOPY_COARSE_X) | (cx & 31);
 }
 
-#define ATTR_TABLE_BASE(ntaddr) ((ntaddr & 0x2c00) + 0x3c0)
-#define PATTERN_TABLE_BASE() (BG_PATTERN_TABLE_SEL ? PATTERN_TABLE_1 : PATTERN_TABLE_0)
+// next line: fine y, then coarse y, which wraps into the next nametable at
+// row 30 (rows 30 and 31 wrap without switching)
+static uint16_t increment_y(uint16_t v) {
+    if ((v & LOOPY_FINE_Y) != LOOPY_FINE_Y) {
+        return v + 0x1000;
+    }
+    v &= ~LOOPY_FINE_Y;
+    int cy = (v & LOOPY_COARSE_Y) >> 5;
+    if (cy == 29) {
+        cy = 0;
+        v ^= LOOPY_NT_Y;
+    } else if (cy == 31) {
+        cy = 0;
+    } else {
+        cy++;
+    }
+    return (v & ~LOOPY_COARSE_Y) | (cy << 5);
+}
 
-void blitBGLine(uint8_t py, uint8_t *line) {
-    extern int frame_step;
-    int y = py + SCROLL_Y;
-    uint16_t ptbase   = PATTERN_TABLE_BASE();
-    uint32_t ntaddr   =      getNameTableAddr() + (y / 8) * 32 + SCROLL_X / 8;
-    uint16_t attraddr = ATTR_TABLE_BASE(ntaddr) + (y / 32) * 8 + SCROLL_X / 32;
+// Renders the background pixels [x0, x1) of the current line from v. v
+// points at the tile under pixel x0, whole tiles are composed and the span
+// is cut out at the fine x offset. v is not moved here.
+void blitBGSpan(nes_t *nes, uint32_t x0, uint32_t x1, uint8_t *line) {
+    ppu_t *ppu = &nes->ppu;
+    const cartridge_t *cartridge = &nes->cartridge;
+    uint16_t v = ppu->v;
+    const uint16_t ptbase = PATTERN_TABLE_BASE() + (v >> 12);
+    const int first = (ppu->fine_x + x0) / 8;
+    const int last = (ppu->fine_x + x1 - 1) / 8;
+    uint8_t tiles[(FRAME_W / 8 + 1) * 8];
     uint8_t attr = 0;
-    uint8_t attrbits = 0;
-    uint8_t chr1 = 0;
-    uint8_t chr2 = 0;
-    int line_x = 0;
-    if (frame_step) printf("attraddr %04X\n", attraddr);
-    for (int x = SCROLL_X; x < SCROLL_X + FRAME_W; x++) {
-        if (x == FRAME_W) {
-            // NT switch for horiz scroll --> toggle bit 10
-            ntaddr = ((ntaddr & 0x2c00) ^ 0x400) + (y / 8) * 32;
-            attraddr = ATTR_TABLE_BASE(ntaddr) + (y / 32) * 8;
-            if (frame_step) printf("NT switch attraddr %04X\n", attraddr);
+    for (int i = 0; i <= last - first; i++) {
+        const int cx = v & LOOPY_COARSE_X;
+        const int cy = (v & LOOPY_COARSE_Y) >> 5;
+        if (i == 0 || cx % 4 == 0) {
+            // one attribute byte covers 4x4 tiles
+            attr = cartridge_nt_read(cartridge, 0x23c0 | (v & 0x0c00) | ((cy >> 2) << 3) | (cx >> 2));
         }
-        if (x == SCROLL_X || x % 8 == 0) {
-            // fetch tile
-            uint8_t tile_idx = cartridge_ppu_read(ntaddr++);
-            uint16_t tile_addr = ptbase + 16 * tile_idx;
-            chr1 = cartridge_ppu_read(tile_addr + (y % 8));
-            chr2 = cartridge_ppu_read(tile_addr + (y % 8) + 8);
-            if (x % 16 == 0 || x == SCROLL_X) {
-                if (x % 32 == 0 || x == SCROLL_X) {
-                    // fetch attribute
-                    attr = cartridge_ppu_read(attraddr++);
-                }
-                uint8_t attrbit_idx = ((x % 32) > 15) ? 2 : 0;
-                attrbit_idx += ((y % 32) > 15) ? 4 : 0;
-                attrbits = ((attr >> attrbit_idx) & 0x03) << 2;
-            }
-        }
-        int bitidx = 7 - (x % 8);
-        line[line_x++] = ((chr1 >> bitidx) & 1) | (((chr2 >> bitidx) & 1) << 1)  | attrbits;
+        uint8_t tile_idx = cartridge_nt_read(cartridge, v);
+        uint64_t row = cartridge_chr_row(cartridge, ptbase + 16 * tile_idx, false);
+        uint8_t attrbits = ((attr >> (((cy & 2) ? 4 : 0) + ((cx & 2) ? 2 : 0))) & 0x03) << 2;
+        row |= BYTES8(attrbits);
+        memcpy(&tiles[i * 8], &row, 8);
+        v = advance_coarse_x(v, 1);
     }
+    memcpy(&line[x0], &tiles[(ppu->fine_x + x0) % 8], x1 - x0);
 }
 
-int blitSpriteLine(uint8_t y, uint8_t *line) {
+int blitSpriteLine(nes_t *nes, uint8_t y, uint8_t *line) {
+    ppu_t *ppu = &nes->ppu;
+    const cartridge_t *cartridge = &nes->cartridge;
     const uint16_t ptbase = SPRITE_PATTERN_TABLE_SEL ? PATTERN_TABLE_1 : PATTERN_TABLE_0;
+    const int height = SPRITE_SIZE_8x16 ? 16 : 8;
     int s0_hit_pos = -1;
-    oam_collectSprites(y);
-    for (int t = 0; t < 8; t++) {
-        uint8_t sprite_idx = local_sprites[t];
-        if (sprite_idx == 0xff) {
+    if (ppu->sprites_dirty || ppu->sprites_first != ppu->oam_addr || ppu->sprites_height != height) {
+        build_sprite_index(ppu);
+    }
+    int count = ppu->line_count[y];
+    if (count == 0) {
+        return -1;
+    }
+    if (count > 8) {
+        ppu->status |= SPRITE_OVERFLOW_MASK;
+        count = 8;
+    }
+    memset(line, 0, FRAME_W);
+    ppu->line_has_sprites = true;
+    for (int t = 0; t < count; t++) {
+        uint8_t sprite_idx = ppu->line_sprites[y][t];
+        const sprite_t *sprite = (sprite_t*)&ppu->oam[sprite_idx];
+        if (sprite->attr & 0x20) {
+            continue; // behind background
+        }
+        int ty = y - sprite->y;
+        if (sprite->attr & 0x80) {
+             ty = height - 1 - ty; // flip y
+        }
+        uint16_t addr;
+        if (height == 16) {
+            // bit 0 of the index selects the pattern table, rows 8..15 come
+            // from the next tile
+            addr = ((sprite->index & 1) ? PATTERN_TABLE_1 : PATTERN_TABLE_0) +
+                   (sprite->index & 0xfe) * 16 + (ty & 8) * 2 + (ty & 7);
+        } else {
+            addr = ptbase + sprite->index * 16 + ty;
+        }
+        uint64_t row = cartridge_chr_row(cartridge, addr, sprite->attr & 0x40);
+        // 0xff in every byte with a non-transparent pixel
+        uint64_t opaque = ((row | (row >> 1)) & BYTES8(0x01)) * 0xff;
+        if (sprite->x < 8 && !SPRITES_LEFT_ENABLED) {
+            // hide the pixels in the leftmost 8 columns
+            int hidden = 8 - sprite->x;
+            opaque = (hidden == 8) ? 0 : opaque & (~0ull << (8 * hidden));
+        }
+        if (sprite->x > FRAME_W - 8) {
+            // clipped at the right edge
+            opaque &= ~0ull >> (8 * (sprite->x - (FRAME_W - 8)));
+        }
+        if (opaque == 0) {
             continue;
         }
-        const sprite_t *sprite = (sprite_t*)&oam[sprite_idx];
-        if (y >= sprite->y && y < sprite->y + 8) {
-            int ty = y - sprite->y;
-            if (sprite->attr & 0x80) {
-                 ty = 7 - ty; // flip y
-            }
-            uint16_t addr = ptbase + sprite->index * 16 + ty;
-            uint8_t chr1 = cartridge_ppu_read(addr);
-            uint8_t chr2 = cartridge_ppu_read(addr + 8);
-            for (int x = 0; x < 8; x++) {
-                int bitidx = (sprite->attr & 0x40) ? x : (7 - x); // flip x
-                uint8_t sprcol = 0x10 | ((chr1 >> bitidx) & 1) | (((chr2 >> bitidx) & 1) << 1) | ((sprite->attr & 3) << 2);
-                if (!(sprite->attr & 0x20) && (sprcol % 4)) {
-                    if (sprite->x + x > 7 || SPRITES_LEFT_ENABLED) {
-                        line[sprite->x + x] = sprcol;
-                        if ((local_sprites[t] == oam_addr) && (s0_hit_pos < 0)) {
-                            s0_hit_pos = sprite->x + x;
-                        }
-                    }
+        uint64_t sprcol = row | BYTES8(0x10 | ((sprite->attr & 3) << 2));
+        if (sprite->x <= FRAME_W - 8) {
+            uint64_t px;
+            memcpy(&px, &line[sprite->x], 8);
+            px = (px & ~opaque) | (sprcol & opaque);
+            memcpy(&line[sprite->x], &px, 8);
+        } else {
+            for (int x = 0; sprite->x + x < FRAME_W; x++) {
+                if ((opaque >> (8 * x)) & 0xff) {
+                    line[sprite->x + x] = sprcol >> (8 * x);
                 }
             }
         }
+        if ((sprite_idx == ppu->sprites_first) && (s0_hit_pos < 0)) {
+            s0_hit_pos = sprite->x + __builtin_ctzll(opaque) / 8;
+        }
     }
     if (s0_hit_pos == 255) {
         s0_hit_pos = -1;
@@ -275,64 +450,199 @@ int blitSpriteLine(uint8_t y, uint8_t *line) {
 }
 
 
-void ppu_tick(void) {
-    static uint8_t scanline[FRAME_W];
+// Dot of a rendering line at which ppu address line a12 rises once, as
+// seen by the MMC3 irq counter, -1 if there is none. The rise happens on the
+// first fetch from $1000 after the fetches from $0000, which is either the
+// sprite fetch in hblank or the background prefetch for the next line.
+static int a12_rise_dot(const ppu_t *ppu) {
+    if (!SHOW_BG_ENABLED && !SHOW_SPRITES_ENABLED) {
+        return -1;
+    }
+    if (SPRITE_PATTERN_TABLE_SEL || SPRITE_SIZE_8x16) {
+        return 260;
+    }
+    if (BG_PATTERN_TABLE_SEL) {
+        return 324;
+    }
+    return -1;
+}
 
-    uint32_t frame_pixel_idx = tick % TICKS_PER_FRAME;
-    uint32_t y = frame_pixel_idx / TOTAL_FRAME_W;
-    uint32_t x = frame_pixel_idx % TOTAL_FRAME_W;
-    int hit_xpos = -1;
+static inline bool is_render_line(uint32_t y) {
+    return y < FRAME_H || y == TOTAL_FRAME_H - 1;
+}
 
-    if (x == 0) {
+uint64_t ppu_a12_rise(nes_t *nes) {
+    const ppu_t *ppu = &nes->ppu;
+    int dot = a12_rise_dot(ppu);
+    if (dot < 0) {
+        return SCHED_NEVER;
+    }
+    uint64_t line_start = ppu->tick - ppu->tick % TOTAL_FRAME_W;
+    uint32_t y = (ppu->tick % TICKS_PER_FRAME) / TOTAL_FRAME_W;
+    if (ppu->tick - line_start > (uint64_t)dot) {
+        // already past it on this line
+        line_start += TOTAL_FRAME_W;
+        y = (y + 1) % TOTAL_FRAME_H;
+    }
+    if (!is_render_line(y)) {
+        // skip to the pre-render line
+        line_start += (TOTAL_FRAME_H - 1 - y) * TOTAL_FRAME_W;
+    }
+    // the dot is done once the ppu has synced past it
+    return line_start + dot + 1;
+}
+
+// Opaque sprite pixels over the background, 8 at a time since most of a
+// line has none
+static void merge_sprites(uint8_t *dst, const uint8_t *spr, uint32_t n) {
+    uint32_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t s;
+        memcpy(&s, &spr[i], 8);
+        if (s == 0) {
+            continue;
+        }
+        for (int j = 0; j < 8; j++) {
+            if (spr[i + j]) {
+                dst[i + j] = spr[i + j];
+            }
+        }
+    }
+    for (; i < n; i++) {
+        if (spr[i]) {
+            dst[i] = spr[i];
+        }
+    }
+}
+
+// Stores pixels [x0, x1) of the current line as nes colors
+static void raw_span(ppu_t *ppu, uint32_t y, uint32_t x0, uint32_t x1) {
+    const uint8_t grey = (ppu->mask & 0x01) ? 0x30 : 0x3f;
+    uint8_t colors[32];
+    for (int i = 0; i < 32; i++) {
+        colors[i] = ppu->palette_ram[(i % 4) ? i : 0] & grey;
+    }
+    uint8_t *dst = &ppu->raw->pixels[y * FRAME_W];
+    for (uint32_t x = x0; x < x1; x++) {
+        dst[x] = colors[ppu->scanline[x]];
+    }
+    ppu->raw->emphasis[y] = ppu->mask >> 5;
+}
+
+// Renders dots [x0, x1) of line y. Spans never cross a line end. The
+// background is fetched per span from v, so register writes between two
+// syncs take effect at the dot they were made; a frame without mid-frame
+// writes is rendered in whole lines.
+static void render_span(nes_t *nes, uint32_t y, uint32_t x0, uint32_t x1) {
+    ppu_t *ppu = &nes->ppu;
+    uint8_t *scanline = ppu->scanline;
+
+    if (x0 == 0) {
         // beginning of line
+        ppu->hit_xpos = -1;
         if (y == 0) {
             // beginning of frame
-            memset(scanline, 0, sizeof(scanline));
-            ppu_status &= ~VBLANK_MASK;
-            ppu_status &= ~SPRITE0HIT_MASK;
-            sprite0hit = false;
-            interrupt = false;
+            ppu->status &= ~VBLANK_MASK;
+            ppu->status &= ~(SPRITE0HIT_MASK | SPRITE_OVERFLOW_MASK);
+            ppu->sprite0hit = false;
+            ppu->interrupt = false;
+            if (ppu->raw) {
+                // 8 samples of the 12 phase color subcarrier per dot
+                ppu->raw->phase = (ppu->tick % 3) * 8 % 12;
+            }
         }
+        ppu->line_has_sprites = false;
         if (y < FRAME_H) {
-            if (SHOW_BG_ENABLED) {
-                blitBGLine(y, scanline);
-            }
+            PERF_INC(nes, ppu_lines);
+            // sprites are evaluated on skipped frames too, for sprite 0 hit
             if (SHOW_SPRITES_ENABLED) {
-                hit_xpos = blitSpriteLine(y, scanline);
+                ppu->hit_xpos = blitSpriteLine(nes, y, ppu->sprite_line);
             }
         }
-    } else {
-        if (x == 1) {
-            if (y == FRAME_H+1) {
-                // last visible line done
-                ppu_status |= VBLANK_MASK;
-                interrupt = true;
-            }
+    }
+    if (x0 <= 1 && x1 > 1) {
+        if (y == FRAME_H+1) {
+            // last visible line done
+            ppu->status |= VBLANK_MASK;
+            ppu->interrupt = true;
         }
     }
 
-    if (x < FRAME_W) {
-        if (y < FRAME_H) {
+    if (y < FRAME_H) {
+        if (x0 < FRAME_W) {
             // Visible pixels
-            if (hit_xpos == x) {
-                ppu_status |= SPRITE0HIT_MASK;
+            uint32_t end = (x1 < FRAME_W) ? x1 : FRAME_W;
+            if (ppu->hit_xpos >= (int)x0 && ppu->hit_xpos < (int)end) {
+                ppu->status |= SPRITE0HIT_MASK;
             }
-            setpixel(x, y, scanline[x]);
-        }
-    } else {
-        // HBLANK
-        if(y < FRAME_H) {
-            if (x > 255) {
-                if (SHOW_SPRITES_ENABLED) {
-                    oam_addr = 0;
+            if (!ppu->skip) {
+                if (SHOW_BG_ENABLED) {
+                    blitBGSpan(nes, x0, end, scanline);
+                } else {
+                    memset(&scanline[x0], 0, end - x0);
+                }
+                if (ppu->line_has_sprites) {
+                    merge_sprites(&scanline[x0], &ppu->sprite_line[x0], end - x0);
+                }
+                if (!ppu->raw_only) {
+                    convert(&ppu->pixels[y * FRAME_W + x0], &scanline[x0], end - x0, ppu->palette);
                 }
+                if (ppu->raw) {
+                    raw_span(ppu, y, x0, end);
+                }
+            }
+            if (RENDERING_ENABLED) {
+                // tiles passed in this span
+                int tiles = (ppu->fine_x + end) / 8 - (ppu->fine_x + x0) / 8;
+                ppu->v = advance_coarse_x(ppu->v, tiles);
+            }
+        }
+        if (x1 > FRAME_W) {
+            // HBLANK
+            if (SHOW_SPRITES_ENABLED) {
+                ppu->oam_addr = 0;
             }
         }
     }
 
-    tick++;
+    if (RENDERING_ENABLED && is_render_line(y)) {
+        if (x0 <= 256 && x1 > 256) {
+            ppu->v = increment_y(ppu->v);
+        }
+        if (x0 <= 257 && x1 > 257) {
+            ppu->v = (ppu->v & ~LOOPY_HORIZONTAL) | (ppu->t & LOOPY_HORIZONTAL);
+        }
+        if (y == TOTAL_FRAME_H - 1 && x0 <= 280 && x1 > 280) {
+            // dots 280..304 of the pre-render line
+            ppu->v = (ppu->v & ~LOOPY_VERTICAL) | (ppu->t & LOOPY_VERTICAL);
+        }
+    }
+
+    if (nes->cartridge.mapper_scanline && is_render_line(y)) {
+        int dot = a12_rise_dot(ppu);
+        if (dot >= (int)x0 && dot < (int)x1) {
+            PERF_INC(nes, mapper_irq);
+            nes->cartridge.mapper_scanline(nes);
+        }
+    }
+}
 
-    if (SPRITE_SIZE_8x16) {
-        printf("8x16 sprites not supported\n");
+void ppu_sync(nes_t *nes) {
+    ppu_t *ppu = &nes->ppu;
+    if (ppu->tick >= nes->clock) {
+        return;
+    }
+    PERF_START(start);
+    while (ppu->tick < nes->clock) {
+        uint32_t frame_pixel_idx = ppu->tick % TICKS_PER_FRAME;
+        uint32_t y = frame_pixel_idx / TOTAL_FRAME_W;
+        uint32_t x = frame_pixel_idx % TOTAL_FRAME_W;
+        uint32_t end = TOTAL_FRAME_W;
+        if (nes->clock - ppu->tick < end - x) {
+            end = x + (nes->clock - ppu->tick);
+        }
+        render_span(nes, y, x, end);
+        ppu->tick += end - x;
     }
+    PERF_STOP(nes, ppu_ns, start);
 }
@@ -25,6 +25,67 @@
 #define BLANK_W (TOTAL_FRAME_W - FRAME_W)
 #define BLANK_H (TOTAL_FRAME_H - FRAME_H)
 
+typedef struct nes_t nes_t;
+
+// A frame as nes colors instead of rgba, for the video filters: the 6 bit
+// color of every pixel (greyscale applied) and the emphasis bits ($2001 bits
+// 5-7) of every line
+typedef struct {
+    uint8_t pixels[FRAME_W * FRAME_H];
+    uint8_t emphasis[FRAME_H];
+    uint8_t phase; // ntsc color phase of line 0, in 1/12 subcarrier cycles
+} ppu_raw_frame_t;
+
+typedef struct {
+    uint64_t tick; // dots rendered so far, lags behind nes->clock until synced
+    uint32_t pixels[FRAME_W * FRAME_H];
+    uint32_t palette[32]; // palette ram resolved to rgba, rebuilt on writes
+    // set by the front end if a video filter wants the frame in nes colors
+    // too, not part of the state
+    ppu_raw_frame_t *raw;
+    bool raw_only; // with raw: nothing needs the rgba pixels[], not rendered
+    uint8_t scanline[FRAME_W];
+    // sprite pixels of the current line (0: none), merged per rendered span
+    uint8_t sprite_line[FRAME_W];
+    bool line_has_sprites;
+    int hit_xpos; // sprite 0 hit position in the current line, -1 if none
+    bool interrupt;
+    bool sprite0hit;
+    // frame is not displayed: pixels[] is left alone, only what the cpu can
+    // observe (status flags, sprite 0 hit, mapper irq timing) is emulated
+    bool skip;
+
+    uint8_t ctrl;
+    uint8_t mask;
+    uint8_t status;
+    // v: vram address, and the scroll position while rendering. t: the
+    // address $2000/$2005/$2006 set up, copied to v at the end of each line
+    // (horizontal part) and on the pre-render line (vertical part).
+    // w: the first/second write latch shared by $2005 and $2006.
+    uint16_t v;
+    uint16_t t;
+    uint8_t fine_x;
+    bool w;
+    uint8_t data;
+    uint8_t oam_addr;
+
+    // nametable ram, the first 2k on the console, all 4k with four-screen
+    // carts. Reached through cartridge.nametable[].
+    uint8_t ciram[0x1000];
+    uint8_t palette_ram[0x20];
+    uint8_t oam[0x100];
+
+    // Sprites per visible line as oam offsets, the first 8 in oam order, and
+    // how many there are in total (more than 8: overflow). Rebuilt from oam
+    // before a line is rendered if oam was written, the sprite height changed
+    // or evaluation starts at another oam_addr.
+    uint8_t line_sprites[FRAME_H][8];
+    uint8_t line_count[FRAME_H];
+    bool sprites_dirty;
+    uint8_t sprites_first;  // oam_addr the index was built from (sprite 0)
+    uint8_t sprites_height; // 8 or 16
+} ppu_t;
+
 typedef enum {
     PPUCTRL    = 0x2000,
     PPUMASK    = 0x2001,
@@ -37,13 +98,24 @@ typedef enum {
     OAMDMA 	   = 0x4014,
 } ppu_register;
 
-bool ppu_interrupt(void);
-const uint32_t *ppu_getFrameBuffer(void);
-bool ppu_should_draw(void);
+void ppu_init(nes_t *nes);
+// rebuilds derived state after the registers and vram were loaded
+void ppu_restore(nes_t *nes);
+const uint32_t *ppu_getFrameBuffer(nes_t *nes);
+
+// scheduler event handlers, return true if the nmi line is raised
+bool ppu_vblank(nes_t *nes, uint64_t time);
+void ppu_frame_end(nes_t *nes, uint64_t time);
 
-void ppu_write(uint8_t addr, uint8_t dat);
-uint8_t ppu_read(uint8_t addr);
+void ppu_write(nes_t *nes, uint8_t addr, uint8_t dat);
+// writes a 256 byte page to oam starting at OAMADDR, as $4014 does
+void ppu_oam_dma(nes_t *nes, const uint8_t *src);
+uint8_t ppu_read(nes_t *nes, uint8_t addr);
 
-void ppu_tick(void);
+// renders all dots up to nes->clock
+void ppu_sync(nes_t *nes);
+// master clock at which the ppu has passed the next rise of address line
+// a12 (clocking the MMC3 irq counter), SCHED_NEVER while there is none
+uint64_t ppu_a12_rise(nes_t *nes);
 
 #endif
\ No newline at end of file
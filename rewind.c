@@ -0,0 +1,213 @@
+#include "rewind.h"
+#include "nes.h"
+#include <stdlib.h>
+#include <string.h>
+
+// zero runs shorter than this are cheaper to keep inside a literal
+#define MIN_ZERO_RUN 4
+
+typedef struct {
+    uint32_t offset;
+    uint32_t len;
+} rewind_entry_t;
+
+struct rewind_t {
+    uint32_t interval;
+    uint32_t frames; // frames since the last snapshot
+
+    size_t state_size;
+    uint8_t *state;   // newest snapshot in full, NULL until the first one
+    uint8_t *scratch; // state being taken
+    uint8_t *packed;  // compressed delta being built
+
+    // delta ring, entries[first] is the oldest delta
+    uint8_t *buf;
+    size_t capacity;
+    size_t head;
+    size_t used;
+    rewind_entry_t *entries;
+    int max_entries;
+    int first;
+    int count;
+};
+
+static uint8_t *put_varint(uint8_t *p, size_t v) {
+    while (v >= 0x80) {
+        *p++ = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    *p++ = v;
+    return p;
+}
+
+static const uint8_t *get_varint(const uint8_t *p, size_t *v) {
+    size_t shift = 0;
+    *v = 0;
+    do {
+        *v |= (size_t)(*p & 0x7f) << shift;
+        shift += 7;
+    } while (*p++ & 0x80);
+    return p;
+}
+
+// Packs a ^ b as a list of (zero run, literal length, literal bytes)
+// records, returns the packed size. dst needs room for size + size / 64 + 16.
+static size_t pack_delta(uint8_t *dst, const uint8_t *a, const uint8_t *b, size_t size) {
+    uint8_t *p = dst;
+    size_t i = 0;
+    while (i < size) {
+        size_t start = i;
+        while (i < size && a[i] == b[i]) {
+            i++;
+        }
+        size_t zeros = i - start;
+        size_t lit = i;
+        size_t run = 0;
+        while (i < size && run < MIN_ZERO_RUN) {
+            run = (a[i] == b[i]) ? run + 1 : 0;
+            i++;
+        }
+        if (run == MIN_ZERO_RUN) {
+            i -= run;
+        }
+        p = put_varint(p, zeros);
+        p = put_varint(p, i - lit);
+        for (; lit < i; lit++) {
+            *p++ = a[lit] ^ b[lit];
+        }
+    }
+    return p - dst;
+}
+
+static void unpack_delta(uint8_t *state, const uint8_t *src, size_t len) {
+    const uint8_t *end = src + len;
+    size_t pos = 0;
+    while (src < end) {
+        size_t zeros, lit;
+        src = get_varint(src, &zeros);
+        src = get_varint(src, &lit);
+        pos += zeros;
+        for (size_t i = 0; i < lit; i++) {
+            state[pos++] ^= *src++;
+        }
+    }
+}
+
+static rewind_entry_t *entry(rewind_t *rw, int i) {
+    return &rw->entries[(rw->first + i) % rw->max_entries];
+}
+
+static void drop_oldest(rewind_t *rw) {
+    rw->used -= entry(rw, 0)->len;
+    rw->first = (rw->first + 1) % rw->max_entries;
+    rw->count--;
+}
+
+// appends a packed delta, dropping the oldest ones to make room
+static void push_delta(rewind_t *rw, size_t len) {
+    if (len > rw->capacity) {
+        rw->count = 0;
+        rw->used = 0;
+        return;
+    }
+    if (rw->head + len > rw->capacity) {
+        // everything behind head is from the previous lap and older than
+        // what the wrapped delta would overwrite first
+        while (rw->count > 0 && entry(rw, 0)->offset >= rw->head) {
+            drop_oldest(rw);
+        }
+        rw->head = 0;
+    }
+    while (rw->count > 0) {
+        const rewind_entry_t *e = entry(rw, 0);
+        bool overlaps = e->offset < rw->head + len && e->offset + e->len > rw->head;
+        if (!overlaps && rw->count < rw->max_entries) {
+            break;
+        }
+        drop_oldest(rw);
+    }
+    memcpy(rw->buf + rw->head, rw->packed, len);
+    rewind_entry_t *e = entry(rw, rw->count);
+    e->offset = rw->head;
+    e->len = len;
+    rw->count++;
+    rw->head += len;
+    rw->used += len;
+}
+
+rewind_t *rewind_create(const nes_t *nes, size_t capacity, uint32_t interval) {
+    rewind_t *rw = (rewind_t*)calloc(1, sizeof(rewind_t));
+    if (rw == NULL) {
+        return NULL;
+    }
+    rw->interval = interval ? interval : 1;
+    rw->state_size = nes_state_size(nes);
+    rw->scratch = (uint8_t*)malloc(rw->state_size);
+    rw->packed = (uint8_t*)malloc(rw->state_size + rw->state_size / 64 + 16);
+    rw->capacity = capacity;
+    rw->buf = (uint8_t*)malloc(capacity);
+    // even an idle frame changes the clocks, deltas are never tiny
+    rw->max_entries = capacity / 64 + 1;
+    rw->entries = (rewind_entry_t*)malloc(rw->max_entries * sizeof(rewind_entry_t));
+    if (!rw->scratch || !rw->packed || !rw->buf || !rw->entries) {
+        rewind_destroy(rw);
+        return NULL;
+    }
+    return rw;
+}
+
+void rewind_destroy(rewind_t *rw) {
+    if (rw == NULL) {
+        return;
+    }
+    free(rw->state);
+    free(rw->scratch);
+    free(rw->packed);
+    free(rw->buf);
+    free(rw->entries);
+    free(rw);
+}
+
+void rewind_frame(rewind_t *rw, const nes_t *nes) {
+    if (rw->state && ++rw->frames < rw->interval) {
+        return;
+    }
+    rw->frames = 0;
+    if (rw->state == NULL) {
+        rw->state = (uint8_t*)malloc(rw->state_size);
+        if (rw->state == NULL) {
+            return;
+        }
+        nes_save_state(nes, rw->state, rw->state_size);
+        return;
+    }
+    nes_save_state(nes, rw->scratch, rw->state_size);
+    // the delta turns the new state back into the previous one
+    push_delta(rw, pack_delta(rw->packed, rw->scratch, rw->state, rw->state_size));
+    uint8_t *tmp = rw->state;
+    rw->state = rw->scratch;
+    rw->scratch = tmp;
+}
+
+bool rewind_step_back(rewind_t *rw, nes_t *nes, int count) {
+    if (rw->state == NULL) {
+        return false;
+    }
+    for (; count > 0 && rw->count > 0; count--) {
+        const rewind_entry_t *e = entry(rw, rw->count - 1);
+        unpack_delta(rw->state, rw->buf + e->offset, e->len);
+        rw->head = e->offset;
+        rw->used -= e->len;
+        rw->count--;
+    }
+    rw->frames = 0;
+    return nes_load_state(nes, rw->state, rw->state_size);
+}
+
+int rewind_count(const rewind_t *rw) {
+    return rw->count;
+}
+
+size_t rewind_used(const rewind_t *rw) {
+    return rw->used;
+}
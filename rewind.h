@@ -0,0 +1,32 @@
+#ifndef _REWIND_H
+#define _REWIND_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct nes_t nes_t;
+
+// Rewind history of one console in a fixed amount of memory. Every interval
+// frames a save state is taken, stored as the run length compressed xor
+// against the state taken after it. Only the newest state is kept in full,
+// older ones are rebuilt by applying deltas backwards. When the buffer is
+// full the oldest snapshots are dropped.
+
+typedef struct rewind_t rewind_t;
+
+// capacity is the size of the delta buffer in bytes
+rewind_t *rewind_create(const nes_t *nes, size_t capacity, uint32_t interval);
+void rewind_destroy(rewind_t *rw);
+
+// call once per emulated frame, takes a snapshot every interval frames
+void rewind_frame(rewind_t *rw, const nes_t *nes);
+// steps back count snapshots (as far as the history goes) and loads the
+// result into nes, returns false if there was no snapshot to go back to
+bool rewind_step_back(rewind_t *rw, nes_t *nes, int count);
+
+// number of snapshots that can be stepped back to and bytes they use
+int rewind_count(const rewind_t *rw);
+size_t rewind_used(const rewind_t *rw);
+
+#endif
@@ -0,0 +1,72 @@
+#include "ring.h"
+#include <stdatomic.h>
+#include <stdlib.h>
+
+struct ring_t {
+    int16_t *buf;
+    uint32_t mask;
+    // free running counters, written by one side each
+    _Alignas(64) atomic_uint head; // producer
+    _Alignas(64) atomic_uint tail; // consumer
+};
+
+ring_t *ring_create(int capacity) {
+    ring_t *ring = (ring_t*)calloc(1, sizeof(ring_t));
+    if (ring == NULL) {
+        return NULL;
+    }
+    uint32_t size = 1;
+    while (size < (uint32_t)capacity) {
+        size <<= 1;
+    }
+    ring->buf = (int16_t*)calloc(size, sizeof(int16_t));
+    if (ring->buf == NULL) {
+        free(ring);
+        return NULL;
+    }
+    ring->mask = size - 1;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    return ring;
+}
+
+void ring_destroy(ring_t *ring) {
+    if (ring) {
+        free(ring->buf);
+        free(ring);
+    }
+}
+
+int ring_write(ring_t *ring, const int16_t *src, int n) {
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    uint32_t space = ring->mask + 1 - (head - tail);
+    if ((uint32_t)n > space) {
+        n = space;
+    }
+    for (int i = 0; i < n; i++) {
+        ring->buf[(head + i) & ring->mask] = src[i];
+    }
+    atomic_store_explicit(&ring->head, head + n, memory_order_release);
+    return n;
+}
+
+int ring_read(ring_t *ring, int16_t *dst, int n) {
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    uint32_t count = head - tail;
+    if ((uint32_t)n > count) {
+        n = count;
+    }
+    for (int i = 0; i < n; i++) {
+        dst[i] = ring->buf[(tail + i) & ring->mask];
+    }
+    atomic_store_explicit(&ring->tail, tail + n, memory_order_release);
+    return n;
+}
+
+int ring_count(ring_t *ring) {
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    return head - tail;
+}
@@ -0,0 +1,21 @@
+#ifndef _RING_H
+#define _RING_H
+
+#include <stdint.h>
+
+// Lock-free single producer, single consumer ring of audio samples.
+
+typedef struct ring_t ring_t;
+
+// capacity is rounded up to a power of two
+ring_t *ring_create(int capacity);
+void ring_destroy(ring_t *ring);
+
+// producer: appends up to n samples, returns how many fit
+int ring_write(ring_t *ring, const int16_t *src, int n);
+// consumer: takes up to n samples, returns how many there were
+int ring_read(ring_t *ring, int16_t *dst, int n);
+// samples waiting, exact for the consumer, a lower bound for the producer
+int ring_count(ring_t *ring);
+
+#endif
@@ -0,0 +1,44 @@
+#include "sched.h"
+#include <assert.h>
+
+void sched_remove(sched_t *sched, int type) {
+    for (int i = 0; i < sched->count; i++) {
+        if (sched->ev[i].type == type) {
+            for (; i < sched->count - 1; i++) {
+                sched->ev[i] = sched->ev[i + 1];
+            }
+            sched->count--;
+            return;
+        }
+    }
+}
+
+void sched_add(sched_t *sched, int type, uint64_t time) {
+    sched_remove(sched, type);
+    assert(sched->count < SCHED_MAX_EVENTS);
+    // events due at the same time run in type order
+    int i = sched->count;
+    while (i > 0 && (sched->ev[i - 1].time > time ||
+            (sched->ev[i - 1].time == time && sched->ev[i - 1].type > type))) {
+        sched->ev[i] = sched->ev[i - 1];
+        i--;
+    }
+    sched->ev[i].time = time;
+    sched->ev[i].type = type;
+    sched->count++;
+}
+
+int sched_pop(sched_t *sched, uint64_t now, uint64_t *time) {
+    if (sched->count == 0 || sched->ev[0].time > now) {
+        return -1;
+    }
+    int type = sched->ev[0].type;
+    if (time) {
+        *time = sched->ev[0].time;
+    }
+    for (int i = 0; i < sched->count - 1; i++) {
+        sched->ev[i] = sched->ev[i + 1];
+    }
+    sched->count--;
+    return type;
+}
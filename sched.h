@@ -0,0 +1,33 @@
+#ifndef _SCHED_H
+#define _SCHED_H
+
+#include <stdint.h>
+
+// Timestamp ordered queue of pending events, at most one per event type.
+// Times are master clock values (ppu dots).
+
+#define SCHED_MAX_EVENTS 16
+#define SCHED_NEVER UINT64_MAX
+
+typedef struct {
+    uint64_t time;
+    int type;
+} sched_event_t;
+
+typedef struct {
+    sched_event_t ev[SCHED_MAX_EVENTS]; // sorted by time
+    int count;
+} sched_t;
+
+// (re)schedules event type at time
+void sched_add(sched_t *sched, int type, uint64_t time);
+void sched_remove(sched_t *sched, int type);
+
+// removes and returns the earliest event if it is due at now, -1 otherwise
+int sched_pop(sched_t *sched, uint64_t now, uint64_t *time);
+
+static inline uint64_t sched_next(const sched_t *sched) {
+    return sched->count ? sched->ev[0].time : SCHED_NEVER;
+}
+
+#endif
@@ -0,0 +1,157 @@
+// Formats a binary instruction trace (--trace, --trace-stream) as
+// nestest style text.
+//
+// usage: tracefmt trace.bin [out.txt]
+//
+// Cycle, scanline and dot are derived from the master clock of each record:
+// the ppu runs 341 x 262 dots per frame, three per cpu cycle.
+#include <stdio.h>
+#include <string.h>
+#include "../trace.h"
+#include "instruction_table.h"
+
+#define DOTS_PER_LINE 341
+#define LINES_PER_FRAME 262
+#define CPU_CLOCK_DIV 3
+
+// instruction lengths come from d6502 (get_instruction), the names and
+// operand syntax for the text from here
+typedef enum {
+    IMP, ACC, IMM, ZP, ZPX, ZPY, ABS, ABX, ABY, IND, IZX, IZY, REL,
+} addr_mode_t;
+
+typedef struct {
+    const char *name; // NULL for opcodes the 6502 does not document
+    addr_mode_t mode;
+} opcode_t;
+
+static const opcode_t opcodes[256] = {
+    [0x00] = {"BRK", IMP}, [0x01] = {"ORA", IZX}, [0x05] = {"ORA", ZP},  [0x06] = {"ASL", ZP},
+    [0x08] = {"PHP", IMP}, [0x09] = {"ORA", IMM}, [0x0a] = {"ASL", ACC}, [0x0d] = {"ORA", ABS},
+    [0x0e] = {"ASL", ABS}, [0x10] = {"BPL", REL}, [0x11] = {"ORA", IZY}, [0x15] = {"ORA", ZPX},
+    [0x16] = {"ASL", ZPX}, [0x18] = {"CLC", IMP}, [0x19] = {"ORA", ABY}, [0x1d] = {"ORA", ABX},
+    [0x1e] = {"ASL", ABX}, [0x20] = {"JSR", ABS}, [0x21] = {"AND", IZX}, [0x24] = {"BIT", ZP},
+    [0x25] = {"AND", ZP},  [0x26] = {"ROL", ZP},  [0x28] = {"PLP", IMP}, [0x29] = {"AND", IMM},
+    [0x2a] = {"ROL", ACC}, [0x2c] = {"BIT", ABS}, [0x2d] = {"AND", ABS}, [0x2e] = {"ROL", ABS},
+    [0x30] = {"BMI", REL}, [0x31] = {"AND", IZY}, [0x35] = {"AND", ZPX}, [0x36] = {"ROL", ZPX},
+    [0x38] = {"SEC", IMP}, [0x39] = {"AND", ABY}, [0x3d] = {"AND", ABX}, [0x3e] = {"ROL", ABX},
+    [0x40] = {"RTI", IMP}, [0x41] = {"EOR", IZX}, [0x45] = {"EOR", ZP},  [0x46] = {"LSR", ZP},
+    [0x48] = {"PHA", IMP}, [0x49] = {"EOR", IMM}, [0x4a] = {"LSR", ACC}, [0x4c] = {"JMP", ABS},
+    [0x4d] = {"EOR", ABS}, [0x4e] = {"LSR", ABS}, [0x50] = {"BVC", REL}, [0x51] = {"EOR", IZY},
+    [0x55] = {"EOR", ZPX}, [0x56] = {"LSR", ZPX}, [0x58] = {"CLI", IMP}, [0x59] = {"EOR", ABY},
+    [0x5d] = {"EOR", ABX}, [0x5e] = {"LSR", ABX}, [0x60] = {"RTS", IMP}, [0x61] = {"ADC", IZX},
+    [0x65] = {"ADC", ZP},  [0x66] = {"ROR", ZP},  [0x68] = {"PLA", IMP}, [0x69] = {"ADC", IMM},
+    [0x6a] = {"ROR", ACC}, [0x6c] = {"JMP", IND}, [0x6d] = {"ADC", ABS}, [0x6e] = {"ROR", ABS},
+    [0x70] = {"BVS", REL}, [0x71] = {"ADC", IZY}, [0x75] = {"ADC", ZPX}, [0x76] = {"ROR", ZPX},
+    [0x78] = {"SEI", IMP}, [0x79] = {"ADC", ABY}, [0x7d] = {"ADC", ABX}, [0x7e] = {"ROR", ABX},
+    [0x81] = {"STA", IZX}, [0x84] = {"STY", ZP},  [0x85] = {"STA", ZP},  [0x86] = {"STX", ZP},
+    [0x88] = {"DEY", IMP}, [0x8a] = {"TXA", IMP}, [0x8c] = {"STY", ABS}, [0x8d] = {"STA", ABS},
+    [0x8e] = {"STX", ABS}, [0x90] = {"BCC", REL}, [0x91] = {"STA", IZY}, [0x94] = {"STY", ZPX},
+    [0x95] = {"STA", ZPX}, [0x96] = {"STX", ZPY}, [0x98] = {"TYA", IMP}, [0x99] = {"STA", ABY},
+    [0x9a] = {"TXS", IMP}, [0x9d] = {"STA", ABX}, [0xa0] = {"LDY", IMM}, [0xa1] = {"LDA", IZX},
+    [0xa2] = {"LDX", IMM}, [0xa4] = {"LDY", ZP},  [0xa5] = {"LDA", ZP},  [0xa6] = {"LDX", ZP},
+    [0xa8] = {"TAY", IMP}, [0xa9] = {"LDA", IMM}, [0xaa] = {"TAX", IMP}, [0xac] = {"LDY", ABS},
+    [0xad] = {"LDA", ABS}, [0xae] = {"LDX", ABS}, [0xb0] = {"BCS", REL}, [0xb1] = {"LDA", IZY},
+    [0xb4] = {"LDY", ZPX}, [0xb5] = {"LDA", ZPX}, [0xb6] = {"LDX", ZPY}, [0xb8] = {"CLV", IMP},
+    [0xb9] = {"LDA", ABY}, [0xba] = {"TSX", IMP}, [0xbc] = {"LDY", ABX}, [0xbd] = {"LDA", ABX},
+    [0xbe] = {"LDX", ABY}, [0xc0] = {"CPY", IMM}, [0xc1] = {"CMP", IZX}, [0xc4] = {"CPY", ZP},
+    [0xc5] = {"CMP", ZP},  [0xc6] = {"DEC", ZP},  [0xc8] = {"INY", IMP}, [0xc9] = {"CMP", IMM},
+    [0xca] = {"DEX", IMP}, [0xcc] = {"CPY", ABS}, [0xcd] = {"CMP", ABS}, [0xce] = {"DEC", ABS},
+    [0xd0] = {"BNE", REL}, [0xd1] = {"CMP", IZY}, [0xd5] = {"CMP", ZPX}, [0xd6] = {"DEC", ZPX},
+    [0xd8] = {"CLD", IMP}, [0xd9] = {"CMP", ABY}, [0xdd] = {"CMP", ABX}, [0xde] = {"DEC", ABX},
+    [0xe0] = {"CPX", IMM}, [0xe1] = {"SBC", IZX}, [0xe4] = {"CPX", ZP},  [0xe5] = {"SBC", ZP},
+    [0xe6] = {"INC", ZP},  [0xe8] = {"INX", IMP}, [0xe9] = {"SBC", IMM}, [0xea] = {"NOP", IMP},
+    [0xec] = {"CPX", ABS}, [0xed] = {"SBC", ABS}, [0xee] = {"INC", ABS}, [0xf0] = {"BEQ", REL},
+    [0xf1] = {"SBC", IZY}, [0xf5] = {"SBC", ZPX}, [0xf6] = {"INC", ZPX}, [0xf8] = {"SED", IMP},
+    [0xf9] = {"SBC", ABY}, [0xfd] = {"SBC", ABX}, [0xfe] = {"INC", ABX},
+};
+
+// "JMP $C5F5" and friends, returns the instruction length
+static int disassemble(const trace_record_t *rec, char *out, size_t size) {
+    const opcode_t *op = &opcodes[rec->bytes[0]];
+    int len = get_instruction(rec->bytes[0])->len;
+    if (len < 1 || len > 3) {
+        len = 1; // a record holds at most 3 bytes
+    }
+    if (op->name == NULL) {
+        snprintf(out, size, "???");
+        return len;
+    }
+    uint8_t lo = rec->bytes[1];
+    uint16_t abs = lo | (rec->bytes[2] << 8);
+    switch (op->mode) {
+        case IMP: snprintf(out, size, "%s", op->name); break;
+        case ACC: snprintf(out, size, "%s A", op->name); break;
+        case IMM: snprintf(out, size, "%s #$%02X", op->name, lo); break;
+        case ZP:  snprintf(out, size, "%s $%02X", op->name, lo); break;
+        case ZPX: snprintf(out, size, "%s $%02X,X", op->name, lo); break;
+        case ZPY: snprintf(out, size, "%s $%02X,Y", op->name, lo); break;
+        case ABS: snprintf(out, size, "%s $%04X", op->name, abs); break;
+        case ABX: snprintf(out, size, "%s $%04X,X", op->name, abs); break;
+        case ABY: snprintf(out, size, "%s $%04X,Y", op->name, abs); break;
+        case IND: snprintf(out, size, "%s ($%04X)", op->name, abs); break;
+        case IZX: snprintf(out, size, "%s ($%02X,X)", op->name, lo); break;
+        case IZY: snprintf(out, size, "%s ($%02X),Y", op->name, lo); break;
+        case REL:
+            snprintf(out, size, "%s $%04X", op->name, (uint16_t)(rec->pc + 2 + (int8_t)lo));
+            break;
+    }
+    return len;
+}
+
+static void format(FILE *out, const trace_record_t *rec) {
+    char text[32];
+    int len = disassemble(rec, text, sizeof(text));
+    char bytes[12] = "";
+    for (int i = 0; i < len; i++) {
+        snprintf(bytes + i * 3, sizeof(bytes) - i * 3, "%02X ", rec->bytes[i]);
+    }
+    uint64_t dot = rec->clock % (DOTS_PER_LINE * LINES_PER_FRAME);
+    fprintf(out, "%04X  %-9s %-31s A:%02X X:%02X Y:%02X P:%02X SP:%02X PPU:%3u,%3u CYC:%llu\n",
+            rec->pc, bytes, text, rec->a, rec->x, rec->y, rec->p, rec->sp,
+            (unsigned)(dot / DOTS_PER_LINE), (unsigned)(dot % DOTS_PER_LINE),
+            (unsigned long long)(rec->clock / CPU_CLOCK_DIV));
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2 || argc > 3) {
+        printf("usage: %s trace.bin [out.txt]\n", argv[0]);
+        return 1;
+    }
+    FILE *in = fopen(argv[1], "rb");
+    if (in == NULL) {
+        printf("ERROR: Cannot open '%s'\n", argv[1]);
+        return 1;
+    }
+    trace_header_t hdr;
+    if (fread(&hdr, sizeof(hdr), 1, in) != 1 || memcmp(hdr.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0) {
+        printf("ERROR: '%s' is not a trace\n", argv[1]);
+        fclose(in);
+        return 1;
+    }
+    if (hdr.version != TRACE_VERSION || hdr.record_size != sizeof(trace_record_t)) {
+        printf("ERROR: Trace version %u is not supported\n", hdr.version);
+        fclose(in);
+        return 1;
+    }
+    FILE *out = stdout;
+    if (argc == 3 && (out = fopen(argv[2], "w")) == NULL) {
+        printf("ERROR: Cannot write '%s'\n", argv[2]);
+        fclose(in);
+        return 1;
+    }
+    // the count is 0 if the emulator died before closing a stream, so
+    // everything up to the end of the file is read
+    trace_record_t recs[4096];
+    size_t n;
+    while ((n = fread(recs, sizeof(trace_record_t), 4096, in)) > 0) {
+        for (size_t i = 0; i < n; i++) {
+            format(out, &recs[i]);
+        }
+    }
+    fclose(in);
+    if (out != stdout) {
+        fclose(out);
+    }
+    return 0;
+}
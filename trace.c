@@ -0,0 +1,73 @@
+#include "trace.h"
+#include <stdlib.h>
+#include <string.h>
+
+static void write_header(FILE *f, uint64_t count) {
+    trace_header_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+    hdr.version = TRACE_VERSION;
+    hdr.record_size = sizeof(trace_record_t);
+    hdr.count = count;
+    fwrite(&hdr, sizeof(hdr), 1, f);
+}
+
+trace_t *trace_create(uint32_t records, const char *stream_fn) {
+    trace_t *trace = (trace_t*)calloc(1, sizeof(trace_t));
+    if (trace == NULL) {
+        return NULL;
+    }
+    trace->size = records ? records : 1;
+    trace->buf = (trace_record_t*)malloc(trace->size * sizeof(trace_record_t));
+    if (trace->buf == NULL) {
+        free(trace);
+        return NULL;
+    }
+    if (stream_fn) {
+        trace->stream = fopen(stream_fn, "wb");
+        if (trace->stream == NULL) {
+            printf("ERROR: Cannot write '%s'\n", stream_fn);
+            free(trace->buf);
+            free(trace);
+            return NULL;
+        }
+        // the count is patched in when the stream is closed
+        write_header(trace->stream, 0);
+    }
+    return trace;
+}
+
+void trace_flush(trace_t *trace) {
+    if (trace->stream) {
+        fwrite(trace->buf, sizeof(trace_record_t), trace->pos, trace->stream);
+    }
+    // without a stream the ring starts overwriting the oldest records
+    trace->pos = 0;
+}
+
+void trace_destroy(trace_t *trace) {
+    if (trace == NULL) {
+        return;
+    }
+    if (trace->stream) {
+        trace_flush(trace);
+        fseek(trace->stream, 0, SEEK_SET);
+        write_header(trace->stream, trace->count);
+        fclose(trace->stream);
+    }
+    free(trace->buf);
+    free(trace);
+}
+
+bool trace_dump(const trace_t *trace, const char *fn) {
+    FILE *f = fopen(fn, "wb");
+    if (f == NULL) {
+        return false;
+    }
+    // the part after pos is older, if the ring has wrapped at all
+    uint32_t older = (trace->count > trace->pos) ? trace->size - trace->pos : 0;
+    write_header(f, older + trace->pos);
+    bool ok = fwrite(&trace->buf[trace->pos], sizeof(trace_record_t), older, f) == older;
+    ok = fwrite(trace->buf, sizeof(trace_record_t), trace->pos, f) == trace->pos && ok;
+    return fclose(f) == 0 && ok;
+}
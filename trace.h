@@ -0,0 +1,56 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Instruction trace: one fixed size binary record per cpu instruction,
+// written to an in-memory ring (the last N instructions, dumped on demand)
+// or streamed to a file. tools/tracefmt turns the records into text.
+
+#define TRACE_MAGIC "DNESTRC"
+#define TRACE_VERSION 1
+
+typedef struct {
+    uint64_t clock;   // master clock (ppu dots) at the start of the instruction
+    uint16_t pc;
+    uint8_t bytes[3]; // opcode and operands, 0 for memory mapped io
+    uint8_t a, x, y, sp, p;
+} trace_record_t;
+
+// file header, followed by count records
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t count;
+} trace_header_t;
+
+typedef struct {
+    trace_record_t *buf;
+    uint32_t size;
+    uint32_t pos;
+    uint64_t count; // records written since creation
+    FILE *stream;   // streaming: buf is flushed here when full
+} trace_t;
+
+// keeps the last records instructions, or streams all of them to
+// stream_fn if that is given
+trace_t *trace_create(uint32_t records, const char *stream_fn);
+// flushes a stream
+void trace_destroy(trace_t *trace);
+// writes the records in the ring, oldest first, returns false on error
+bool trace_dump(const trace_t *trace, const char *fn);
+
+void trace_flush(trace_t *trace);
+
+static inline trace_record_t *trace_next(trace_t *trace) {
+    if (trace->pos == trace->size) {
+        trace_flush(trace);
+    }
+    trace->count++;
+    return &trace->buf[trace->pos++];
+}
+
+#endif
@@ -0,0 +1,65 @@
+#include "tribuf.h"
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// set in middle when it holds a frame the consumer has not seen
+#define TRIBUF_NEW 4
+
+struct tribuf_t {
+    uint8_t *buf[3];
+    int back;  // owned by the producer
+    int front; // owned by the consumer
+    atomic_int middle; // buffer index, swapped in and out by both
+};
+
+tribuf_t *tribuf_create(size_t size) {
+    tribuf_t *tb = (tribuf_t*)calloc(1, sizeof(tribuf_t));
+    if (tb == NULL) {
+        return NULL;
+    }
+    for (int i = 0; i < 3; i++) {
+        tb->buf[i] = (uint8_t*)calloc(1, size);
+        if (tb->buf[i] == NULL) {
+            tribuf_destroy(tb);
+            return NULL;
+        }
+    }
+    tb->back = 0;
+    tb->front = 1;
+    atomic_init(&tb->middle, 2);
+    return tb;
+}
+
+void tribuf_destroy(tribuf_t *tb) {
+    if (tb == NULL) {
+        return;
+    }
+    for (int i = 0; i < 3; i++) {
+        free(tb->buf[i]);
+    }
+    free(tb);
+}
+
+void *tribuf_back(tribuf_t *tb) {
+    return tb->buf[tb->back];
+}
+
+void tribuf_publish(tribuf_t *tb) {
+    // release: the frame contents are visible before the index
+    int old = atomic_exchange_explicit(&tb->middle, tb->back | TRIBUF_NEW, memory_order_acq_rel);
+    tb->back = old & ~TRIBUF_NEW;
+}
+
+bool tribuf_update(tribuf_t *tb) {
+    if ((atomic_load_explicit(&tb->middle, memory_order_relaxed) & TRIBUF_NEW) == 0) {
+        return false;
+    }
+    int old = atomic_exchange_explicit(&tb->middle, tb->front, memory_order_acq_rel);
+    tb->front = old & ~TRIBUF_NEW;
+    return true;
+}
+
+const void *tribuf_front(const tribuf_t *tb) {
+    return tb->buf[tb->front];
+}
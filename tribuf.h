@@ -0,0 +1,27 @@
+#ifndef _TRIBUF_H
+#define _TRIBUF_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Lock-free triple buffer handing frames from one producer thread to one
+// consumer thread. The producer always has a buffer to write into and the
+// consumer always sees the newest complete frame, neither ever waits.
+
+typedef struct tribuf_t tribuf_t;
+
+tribuf_t *tribuf_create(size_t size);
+void tribuf_destroy(tribuf_t *tb);
+
+// producer: buffer to write the next frame into
+void *tribuf_back(tribuf_t *tb);
+// producer: makes the back buffer the newest frame
+void tribuf_publish(tribuf_t *tb);
+
+// consumer: switches to the newest frame, returns false if there is none
+// since the last call
+bool tribuf_update(tribuf_t *tb);
+// consumer: the frame picked by the last tribuf_update()
+const void *tribuf_front(const tribuf_t *tb);
+
+#endif